@@ -0,0 +1,55 @@
+/*
+ * appender.c
+ * Append lines to a set of files round-robin as fast as possible, used to
+ * generate inotify events for benchmarking inotail.
+ *
+ * This file is licensed under the terms of the GNU General Public License;
+ * version 2 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+/* Every appended line has the same length, so the reader can tell from the
+ * output size when it has seen everything */
+static const char line[] = "0123456789abcdefghijklmnopqrstu\n";
+
+int main(int argc, char **argv)
+{
+	unsigned long i, n_lines;
+	int n_files, *fds;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s LINES FILE...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	n_lines = strtoul(argv[1], NULL, 0);
+	n_files = argc - 2;
+	fds = malloc(n_files * sizeof(int));
+	if (!fds) {
+		fprintf(stderr, "Error: Out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < (unsigned long) n_files; i++) {
+		fds[i] = open(argv[i + 2], O_WRONLY|O_APPEND|O_CREAT, 0644);
+		if (fds[i] < 0) {
+			fprintf(stderr, "Error: Could not open file '%s' (%s)\n", argv[i + 2], strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < n_lines; i++) {
+		if (write(fds[i % n_files], line, sizeof(line) - 1) < 0) {
+			fprintf(stderr, "Error: Could not write (%s)\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
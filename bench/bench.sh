@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Compare inotail against coreutils tail (or whatever $TAIL points to):
+#
+#  - the initial tail (-n, -c and +N) of synthetic logs of varying size and
+#    line length, median wall clock time of $REPEAT runs each
+#  - follow mode throughput (writers appending as fast as they can) and
+#    write-to-output latency percentiles at a fixed rate, with 1 up to 10000
+#    files being appended to concurrently
+#  - the CPU time and latency of inotail -f with and without --coalesce for a
+#    writer doing many small writes
+#
+# Prints one JSON object per measurement.
+#
+# Licensed under the terms of the GNU General Public License; version 2 or later.
+
+INOTAIL=$(readlink -f ${INOTAIL:-./inotail})
+TAIL=${TAIL:-tail}
+LATENCY=$(readlink -f ${LATENCY:-bench/latency})
+SIZES=${SIZES:-"1M 64M 512M"}
+LINE_LENS=${LINE_LENS:-"16 128 4096"}
+REPEAT=${REPEAT:-5}
+WRITERS=${WRITERS:-"1 10 100 1000 10000"}
+FOLLOW_LINES=${FOLLOW_LINES:-200000}
+RATE=${RATE:-20000}
+COALESCE=${COALESCE:-"0 1 5 20"}
+
+now() {
+	date +%s%N
+}
+
+# Median wall clock time in ms of running "$@" $REPEAT times
+time_ms() {
+	i=0
+	while [ $i -lt $REPEAT ]; do
+		start=$(now)
+		"$@" > /dev/null
+		echo $(($(now) - start))
+		i=$((i + 1))
+	done | sort -n | awk '{ t[NR] = $1 } END { printf("%.3f", t[int((NR + 1) / 2)] / 1e6) }'
+}
+
+# Write a log of about $2 bytes consisting of $3 byte lines to $1
+gen_log() {
+	bytes=$(numfmt --from=iec $2)
+	line=$(printf "%*s" $(($3 - 1)) "" | tr ' ' 'x')
+	yes "$line" | head -c $((bytes / $3 * $3)) > "$1"
+}
+
+ulimit -n $(ulimit -Hn) 2>/dev/null
+max_fds=$(ulimit -n)
+max_watches=$(cat /proc/sys/fs/inotify/max_user_watches)
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+for size in $SIZES; do
+	for len in $LINE_LENS; do
+		log="$dir/log"
+		gen_log "$log" $size $len
+		lines=$(($(stat -c %s "$log") / len))
+
+		for args in "-n 10" "-n 10000" "-c 1048576" "-n +$((lines / 2))"; do
+			# Warm the page cache and make sure both agree on the output
+			$INOTAIL $args "$log" > "$dir/a"
+			$TAIL $args "$log" > "$dir/b"
+			cmp -s "$dir/a" "$dir/b" && same=true || same=false
+
+			a=$(time_ms $INOTAIL $args "$log")
+			b=$(time_ms $TAIL $args "$log")
+			awk -v s=$size -v l=$len -v args="$args" -v a=$a -v b=$b -v same=$same 'BEGIN {
+				printf("{\"bench\": \"tail\", \"size\": \"%s\", \"line_len\": %d, \"args\": \"%s\", " \
+				       "\"inotail_ms\": %.3f, \"tail_ms\": %.3f, \"speedup\": %.2f, \"same_output\": %s}\n",
+				       s, l, args, a, b, a > 0 ? b / a : 0, same)
+			}'
+		done
+	done
+	rm -f "$dir/log" "$dir/a" "$dir/b"
+done
+
+for n in $WRITERS; do
+	# Both followers run one after the other, each on its own set of files
+	if [ "$n" -gt "$max_watches" ] || [ "$n" -gt $((max_fds - 64)) ]; then
+		echo "{\"bench\": \"follow\", \"writers\": $n, \"skipped\": \"needs $n inotify watches and file descriptors\"}"
+		continue
+	fi
+
+	for mode in throughput latency; do
+		[ $mode = throughput ] && rate= || rate="-r $RATE"
+		a=$($LATENCY $rate $n $FOLLOW_LINES "$dir" $INOTAIL -q -f -n 0)
+		b=$($LATENCY $rate $n $FOLLOW_LINES "$dir" $TAIL -q -f -n 0)
+		echo "{\"bench\": \"follow\", \"mode\": \"$mode\", \"writers\": $n, \"inotail\": ${a:-null}, \"tail\": ${b:-null}}"
+	done
+done
+
+# Each line is a separate write(), so without --coalesce every one of them
+# wakes up the follower
+for n in 1 100; do
+	for delay in $COALESCE; do
+		[ $delay = 0 ] && opt= || opt="--coalesce=$delay"
+		a=$($LATENCY -r $RATE $n $FOLLOW_LINES "$dir" $INOTAIL -q -f -n 0 $opt)
+		echo "{\"bench\": \"coalesce\", \"writers\": $n, \"delay_ms\": $delay, \"inotail\": ${a:-null}}"
+	done
+done
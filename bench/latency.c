@@ -0,0 +1,328 @@
+/*
+ * latency.c
+ * Run a follower (inotail -f, tail -f, ...) on a set of files, append
+ * timestamped lines to them from several writer threads and measure how long
+ * each line takes to show up on the follower's standard output and how much
+ * CPU time the follower used.
+ *
+ * This file is licensed under the terms of the GNU General Public License;
+ * version 2 or later.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Every line is "<monotonic ns> <padding>\n" and exactly LINE_LEN bytes */
+#define LINE_LEN	64
+/* Files are spread over at most this many writer threads */
+#define MAX_THREADS	32
+/* Give up on lines not seen this long after the last one was written */
+#define DRAIN_TIMEOUT	10000	/* ms */
+
+struct writer {
+	pthread_t tid;
+	int *fds;
+	int n_fds;
+	unsigned long n_lines;
+	double interval;	/* ns between two lines, 0 for as fast as possible */
+	unsigned long long start;
+};
+
+static int writers_done;
+
+static unsigned long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *emalloc(size_t size)
+{
+	void *p = calloc(1, size);
+
+	if (!p) {
+		fprintf(stderr, "Error: Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return p;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	char line[LINE_LEN];
+	unsigned long i;
+
+	memset(line, '.', sizeof(line));
+	line[LINE_LEN - 1] = '\n';
+
+	for (i = 0; i < w->n_lines; i++) {
+		unsigned long long t;
+		int n;
+
+		if (w->interval > 0) {
+			unsigned long long due = w->start + (unsigned long long) (i * w->interval);
+			struct timespec ts;
+
+			ts.tv_sec = due / 1000000000ULL;
+			ts.tv_nsec = due % 1000000000ULL;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		}
+
+		t = now();
+		n = snprintf(line, LINE_LEN, "%llu ", t);
+		line[n] = '.';
+		if (write(w->fds[i % w->n_fds], line, LINE_LEN) != LINE_LEN) {
+			fprintf(stderr, "Error: Could not write (%s)\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	__sync_fetch_and_add(&writers_done, 1);
+	return NULL;
+}
+
+/* Number of inotify watches installed by process pid */
+static int n_watches(pid_t pid)
+{
+	char path[288], buf[4096];
+	struct dirent *de;
+	DIR *dir;
+	int n = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/fdinfo", (int) pid);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	while ((de = readdir(dir))) {
+		FILE *fp;
+
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", (int) pid, de->d_name);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+		while (fgets(buf, sizeof(buf), fp))
+			if (strncmp(buf, "inotify wd", 10) == 0)
+				n++;
+		fclose(fp);
+	}
+
+	closedir(dir);
+	return n;
+}
+
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const unsigned long long *v, unsigned long n, double p)
+{
+	unsigned long i;
+
+	if (n == 0)
+		return 0;
+	i = (unsigned long) (p / 100.0 * (n - 1) + 0.5);
+	return v[i] / 1000.0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-r RATE] WRITERS LINES DIR COMMAND [ARG]...\n"
+			"  Create WRITERS files in DIR, run COMMAND ARG... FILES and append LINES\n"
+			"  lines to the files at RATE lines per second in total (default: as fast\n"
+			"  as possible). Prints the results as a JSON object.\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n_lines, received = 0, i;
+	unsigned long long *lat, start, end = 0, last_write;
+	double rate = 0, secs;
+	int n_files, n_threads, pfd[2], c, ret = EXIT_SUCCESS;
+	int *fds, cmd_argc;
+	char **cmd_argv, *dir, buf[65536];
+	size_t have = 0;
+	struct writer *w;
+	struct rusage ru;
+	pid_t pid;
+
+	while ((c = getopt(argc, argv, "+r:")) != -1) {
+		switch (c) {
+		case 'r':
+			rate = strtod(optarg, NULL);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (argc - optind < 4)
+		usage(argv[0]);
+
+	n_files = strtol(argv[optind], NULL, 0);
+	n_lines = strtoul(argv[optind + 1], NULL, 0);
+	dir = argv[optind + 2];
+	if (n_files < 1 || n_lines < 1)
+		usage(argv[0]);
+
+	cmd_argc = argc - optind - 3;
+	cmd_argv = emalloc((cmd_argc + n_files + 1) * sizeof(char *));
+	memcpy(cmd_argv, argv + optind + 3, cmd_argc * sizeof(char *));
+
+	fds = emalloc(n_files * sizeof(int));
+	for (c = 0; c < n_files; c++) {
+		char *name = emalloc(strlen(dir) + 16);
+
+		sprintf(name, "%s/w%06d", dir, c);
+		fds[c] = open(name, O_WRONLY|O_APPEND|O_CREAT|O_TRUNC, 0644);
+		if (fds[c] < 0) {
+			fprintf(stderr, "Error: Could not open file '%s' (%s)\n", name, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		cmd_argv[cmd_argc + c] = name;
+	}
+
+	if (pipe(pfd) < 0) {
+		fprintf(stderr, "Error: Could not create pipe (%s)\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "Error: Could not fork (%s)\n", strerror(errno));
+		return EXIT_FAILURE;
+	} else if (pid == 0) {
+		dup2(pfd[1], STDOUT_FILENO);
+		close(pfd[0]);
+		close(pfd[1]);
+		for (c = 0; c < n_files; c++)
+			close(fds[c]);
+		execvp(cmd_argv[0], cmd_argv);
+		fprintf(stderr, "Error: Could not run '%s' (%s)\n", cmd_argv[0], strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	close(pfd[1]);
+
+	/* Lines appended before the follower watches a file would be missed */
+	while (n_watches(pid) < n_files) {
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			fprintf(stderr, "Error: '%s' exited prematurely\n", cmd_argv[0]);
+			return EXIT_FAILURE;
+		}
+		usleep(10000);
+	}
+
+	n_threads = n_files < MAX_THREADS ? n_files : MAX_THREADS;
+	w = emalloc(n_threads * sizeof(struct writer));
+	lat = emalloc(n_lines * sizeof(unsigned long long));
+
+	start = now();
+	for (c = 0; c < n_threads; c++) {
+		int j;
+
+		/* Thread c writes to files c, c + n_threads, ... */
+		w[c].n_fds = (n_files - c + n_threads - 1) / n_threads;
+		w[c].fds = emalloc(w[c].n_fds * sizeof(int));
+		for (j = 0; j < w[c].n_fds; j++)
+			w[c].fds[j] = fds[c + j * n_threads];
+		w[c].n_lines = n_lines / n_threads + ((unsigned long) c < n_lines % n_threads);
+		w[c].interval = rate > 0 ? 1e9 * n_threads / rate : 0;
+		w[c].start = start;
+		if (pthread_create(&w[c].tid, NULL, writer_thread, &w[c]) != 0) {
+			fprintf(stderr, "Error: Could not create thread\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	last_write = 0;
+	while (received < n_lines) {
+		struct pollfd p = { .fd = pfd[0], .events = POLLIN };
+		char *s, *nl;
+		ssize_t rd;
+
+		/* Only start the drain timeout once all lines are written */
+		if (!last_write && __sync_add_and_fetch(&writers_done, 0) == n_threads)
+			last_write = now();
+
+		if (poll(&p, 1, 100) < 0 && errno != EINTR)
+			break;
+		if (!(p.revents & (POLLIN|POLLHUP))) {
+			if (last_write && now() - last_write > DRAIN_TIMEOUT * 1000000ULL)
+				break;
+			continue;
+		}
+
+		rd = read(pfd[0], buf + have, sizeof(buf) - have);
+		if (rd <= 0)
+			break;
+		have += rd;
+		end = now();
+
+		s = buf;
+		while ((nl = memchr(s, '\n', have - (s - buf)))) {
+			char *e;
+			unsigned long long t = strtoull(s, &e, 10);
+
+			if (e != s && *e == ' ' && t >= start && t <= end && received < n_lines)
+				lat[received++] = end - t;
+			s = nl + 1;
+		}
+		have -= s - buf;
+		memmove(buf, s, have);
+		if (have == sizeof(buf))
+			have = 0;
+	}
+
+	for (c = 0; c < n_threads; c++)
+		pthread_join(w[c].tid, NULL);
+	kill(pid, SIGTERM);
+	memset(&ru, 0, sizeof(ru));
+	wait4(pid, NULL, 0, &ru);
+
+	if (received < n_lines)
+		ret = EXIT_FAILURE;
+
+	qsort(lat, received, sizeof(unsigned long long), cmp_ull);
+	secs = end > start ? (end - start) / 1e9 : 0;
+	printf("{\"writers\": %d, \"threads\": %d, \"lines\": %lu, \"received\": %lu, "
+			"\"rate\": %.0f, \"seconds\": %.3f, \"lines_per_sec\": %.0f, \"cpu_seconds\": %.3f, "
+			"\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+			"\"p999\": %.1f, \"max\": %.1f}}\n",
+			n_files, n_threads, n_lines, received, rate, secs,
+			secs > 0 ? received / secs : 0,
+			ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+			(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6,
+			percentile(lat, received, 50), percentile(lat, received, 90),
+			percentile(lat, received, 99), percentile(lat, received, 99.9),
+			percentile(lat, received, 100));
+
+	for (i = 0; i < (unsigned long) n_files; i++)
+		unlink(cmd_argv[cmd_argc + i]);
+
+	return ret;
+}
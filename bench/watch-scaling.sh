@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Measure how many appended lines per second 'inotail -f' keeps up with as the
+# number of followed files grows. Every append causes one IN_MODIFY event.
+#
+# Prints one JSON object per file count.
+#
+# Licensed under the terms of the GNU General Public License; version 2 or later.
+
+INOTAIL=$(readlink -f ${INOTAIL:-./inotail})
+APPENDER=$(readlink -f ${APPENDER:-bench/appender})
+COUNTS=${COUNTS:-"1 10 100 1000 10000 100000"}
+# Not LINES, most shells set that to the height of the terminal
+BENCH_LINES=${BENCH_LINES:-200000}
+LINE_LEN=32
+# Seconds to wait for inotail to set up its watches and to output everything
+TIMEOUT=${TIMEOUT:-120}
+
+now() {
+	date +%s%N
+}
+
+# Give up on the file count $1, inotail being $2
+timed_out() {
+	echo "{\"files\": $1, \"error\": \"timed out after $TIMEOUT seconds\"}"
+	kill $2 2>/dev/null
+	exit 1
+}
+
+# Number of inotify watches installed by process $1
+n_watches() {
+	cat /proc/$1/fdinfo/* 2>/dev/null | grep -c '^inotify wd'
+}
+
+max_watches=$(cat /proc/sys/fs/inotify/max_user_watches)
+ulimit -n $(ulimit -Hn) 2>/dev/null
+max_fds=$(ulimit -n)
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+for n in $COUNTS; do
+	if [ "$n" -gt "$max_watches" ] || [ "$n" -gt $((max_fds - 16)) ]; then
+		echo "{\"files\": $n, \"skipped\": \"needs $n inotify watches and file descriptors\"}"
+		continue
+	fi
+
+	rm -rf "$dir/files" "$dir/out"
+	mkdir "$dir/files"
+	(cd "$dir/files" && seq -f 'f%06g' 1 $n | xargs touch)
+
+	(cd "$dir/files" && exec $INOTAIL -q -f -n 0 f* > "$dir/out") &
+	pid=$!
+
+	# Wait until all watches are installed
+	deadline=$(($(date +%s) + TIMEOUT))
+	while [ "$(n_watches $pid)" -lt "$n" ]; do
+		kill -0 $pid 2>/dev/null || exit 1
+		[ "$(date +%s)" -lt $deadline ] || timed_out $n $pid
+		sleep 0.1
+	done
+
+	start=$(now)
+	(cd "$dir/files" && $APPENDER $BENCH_LINES f*)
+	expected=$((BENCH_LINES * LINE_LEN))
+	deadline=$(($(date +%s) + TIMEOUT))
+	while [ "$(stat -c %s "$dir/out")" -lt "$expected" ]; do
+		[ "$(date +%s)" -lt $deadline ] || timed_out $n $pid
+		sleep 0.01
+	done
+	end=$(now)
+
+	kill $pid
+	wait $pid 2>/dev/null
+
+	awk -v n=$n -v l=$BENCH_LINES -v ns=$((end - start)) 'BEGIN {
+		s = ns / 1e9
+		printf("{\"files\": %d, \"lines\": %d, \"seconds\": %.3f, \"lines_per_sec\": %.0f}\n", n, l, s, l / s)
+	}'
+done
@@ -34,9 +34,30 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_X86_SIMD
+# include <immintrin.h>
+#endif
 
 #include "inotail.h"
 
@@ -52,25 +73,187 @@ static char follow = FOLLOW_NONE;
 static char retry = 0;
 /* Number of ignored files */
 static int n_ignored = 0;
+/* The tailed files, in the order given unless files come and go with --glob */
+static struct file_struct **files = NULL;
+static int n_files = 0;
+static int max_files = 0;
+/* Patterns given to --glob and how many of their directories are watched */
+static struct glob_pat *globs = NULL;
+static int n_globs = 0;
+/* Writer process to watch with --pid (or 0) */
+static pid_t writer_pid = 0;
+
+/* The inotify instance used to follow files */
+static int ifd = -1;
+/* The epoll instance driving the main loop */
+static int epfd = -1;
+/* Leave the main loop? Set to the terminating signal if we got one */
+static int quit = 0;
+/* Event sources of the main loop */
+static struct ev_source inotify_src, signal_src, pid_src;
+/* Buffer inotify events are read into, grows with the event rate */
+static char *ev_buf = NULL;
+static size_t ev_buf_len = 0;
+/* Files by inotify watch descriptor */
+static struct htable wd_table;
+/* Directories watched for files followed by name, by watch descriptor and by
+ * path */
+static struct htable dir_wd_table;
+static struct htable dir_path_table;
+/* Files followed by name, by directory and name within the directory */
+static struct htable name_table;
+
+/* Output of followed files, only complete lines of several files are
+ * collected here and written in batches, see out_append() */
+static struct outq out = { NULL, 0, 0 };
+static char line_atomic = 0;
+static struct ev_source flush_src = { -1, NULL };
+/* Whether stdout is full and followed files wait for it to drain */
+static char out_stalled = 0;
+/* Wait for a full stdout instead of stalling, see out_try_write() */
+static char out_blocking = 1;
+static struct ev_source stdout_src = { -1, NULL };
+static int stdout_flags = -1;
+/* How far followed files may fall behind and what to do about it */
+static off_t max_backlog = DEFAULT_MAX_BACKLOG;
+static char backlog_policy = BACKLOG_BLOCK;
+
+/* Let inotify events pile up for coalesce_delay ns before reading them with
+ * --coalesce (0: don't) */
+static long long coalesce_delay = 0;
+static struct ev_source coalesce_src = { -1, NULL };
+static unsigned long long coalesce_start = 0;
+
+/* --state-file and the offsets loaded from it, sorted by file name */
+static const char *state_file = NULL;
+static struct state_entry *state = NULL;
+static size_t n_state = 0;
+/* Whether any file was output since the last checkpoint */
+static char state_dirty = 0;
+static struct ev_source state_src = { -1, NULL };
+
+/* Runtime statistics, dumped on SIGUSR1 and to --stats-file */
+static struct stats stats;
+static const char *stats_file = NULL;
+static struct ev_source stats_src = { -1, NULL };
+/* When the inotify events being handled were read */
+static unsigned long long event_time = 0;
+/* When the oldest event with output still queued in out came in (or 0) */
+static unsigned long long out_since = 0;
+
+/* How to move data from files to stdout, see setup_output() */
+static char copy_method = COPY_RW;
+
+/* Returned by rscan_mapped() if the file got truncated under us */
+#define MAP_TRUNCATED	(-2)
+
+/* Where to go when a mapped file got truncated under us */
+static sigjmp_buf sigbus_env;
+/* Are we currently accessing a mapping? */
+static volatile sig_atomic_t sigbus_armed = 0;
+
+/* Use a line index for 'inotail -n +N'? Where to store it (NULL means next to
+ * the file)? */
+static char line_index = 0;
+static const char *line_index_dir = NULL;
+
+/* Only output lines with timestamps since/until the given times? */
+static char *since_arg = NULL, *until_arg = NULL;
+static time_t since, until;
+/* strptime() format of the timestamps at the beginning of lines */
+static const char *time_format = DEFAULT_TIME_FORMAT;
+
+/* Only output lines matching one of match_filters (if any) and none of
+ * exclude_filters? */
+static struct filter *match_filters = NULL, *exclude_filters = NULL;
+static char filtering = 0;
+/* Are all match_filters literal? */
+static char literal_matches = 1;
+
+/* Number of threads counting newlines for 'inotail -n +N' (0: don't) */
+static long n_threads = 0;
+
+/* Back the I/O buffer with huge pages? */
+static char hugepages = 0;
+
+/* Open and read ahead all files before tailing them (--prefetch)? */
+static char prefetch = 0;
+
+/* Keep what is read out of the page cache (--nocache), reading with O_DIRECT
+ * where possible (--direct)? */
+static char nocache = 0, direct_io = 0;
+/* O_DIRECT descriptor of the file tail_file() is working on, see file_read() */
+static struct {
+	const struct file_struct *f;
+	int fd;
+} direct = { NULL, -1 };
+
+/* Buffer for all file I/O going through user space, see io_buffer() */
+static struct {
+	char *buf;
+	size_t size;
+} io_buf = { NULL, 0 };
+
+#ifdef DEBUG
+/* Number of heap allocations, the follow loop must not do any */
+static unsigned long n_allocs = 0;
+# define count_alloc()	(n_allocs++)
+#else
+# define count_alloc()
+#endif
 
 /* Pseudo-characters for long options that have no equivalent short option */
 enum {
 	RETRY_OPTION = CHAR_MAX + 1,
 	MAX_UNCHANGED_STATS_OPTION,
-	PID_OPTION
+	PID_OPTION,
+	HUGEPAGES_OPTION,
+	LINE_INDEX_OPTION,
+	PARALLEL_OPTION,
+	SINCE_OPTION,
+	UNTIL_OPTION,
+	TIME_FORMAT_OPTION,
+	MATCH_OPTION,
+	EXCLUDE_OPTION,
+	MAX_BACKLOG_OPTION,
+	BACKLOG_POLICY_OPTION,
+	STATE_FILE_OPTION,
+	GLOB_OPTION,
+	STATS_FILE_OPTION,
+	COALESCE_OPTION,
+	NOCACHE_OPTION,
+	DIRECT_OPTION,
+	PREFETCH_OPTION
 };
 
 /* Command line options
  * The ones marked with 'X' are here just for compatibility reasons and have no
  * effect on inotail */
 static const struct option long_opts[] = {
+	{ "backlog-policy", required_argument, NULL, BACKLOG_POLICY_OPTION },
 	{ "bytes", required_argument, NULL, 'c' },
+	{ "coalesce", optional_argument, NULL, COALESCE_OPTION },
+	{ "direct", no_argument, NULL, DIRECT_OPTION },
+	{ "exclude", required_argument, NULL, EXCLUDE_OPTION },
 	{ "follow", optional_argument, NULL, 'f' },
+	{ "glob", required_argument, NULL, GLOB_OPTION },
 	{ "help", no_argument, NULL, 'h' },
+	{ "hugepages", no_argument, NULL, HUGEPAGES_OPTION },
+	{ "line-index", optional_argument, NULL, LINE_INDEX_OPTION },
 	{ "lines", required_argument, NULL, 'n' },
+	{ "match", required_argument, NULL, MATCH_OPTION },
+	{ "max-backlog", required_argument, NULL, MAX_BACKLOG_OPTION },
+	{ "nocache", no_argument, NULL, NOCACHE_OPTION },
+	{ "parallel", optional_argument, NULL, PARALLEL_OPTION },
 	/* X */ { "max-unchanged-stats", required_argument, NULL, MAX_UNCHANGED_STATS_OPTION },
-	/* X */ { "pid", required_argument, NULL, PID_OPTION },
+	{ "pid", required_argument, NULL, PID_OPTION },
+	{ "prefetch", no_argument, NULL, PREFETCH_OPTION },
 	{ "quiet", no_argument, NULL, 'q' },
+	{ "since", required_argument, NULL, SINCE_OPTION },
+	{ "state-file", required_argument, NULL, STATE_FILE_OPTION },
+	{ "stats-file", required_argument, NULL, STATS_FILE_OPTION },
+	{ "time-format", required_argument, NULL, TIME_FORMAT_OPTION },
+	{ "until", required_argument, NULL, UNTIL_OPTION },
 	{ "retry", no_argument, NULL, RETRY_OPTION },
 	{ "silent", no_argument, NULL, 'q' },
 	/* X */ { "sleep-interval", required_argument, NULL, 's' },
@@ -83,6 +266,20 @@ static void *emalloc(const size_t size)
 {
 	void *ret = malloc(size);
 
+	count_alloc();
+	if (unlikely(!ret)) {
+		fprintf(stderr, "Error: Failed to allocate %zu bytes of memory (%s)\n", size, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return ret;
+}
+
+static void *erealloc(void *ptr, const size_t size)
+{
+	void *ret = realloc(ptr, size);
+
+	count_alloc();
 	if (unlikely(!ret)) {
 		fprintf(stderr, "Error: Failed to allocate %zu bytes of memory (%s)\n", size, strerror(errno));
 		exit(EXIT_FAILURE);
@@ -91,6 +288,137 @@ static void *emalloc(const size_t size)
 	return ret;
 }
 
+static void *emalloc_aligned(const size_t align, const size_t size)
+{
+	void *ret;
+	int err = posix_memalign(&ret, align, size);
+
+	count_alloc();
+	if (unlikely(err)) {
+		fprintf(stderr, "Error: Failed to allocate %zu bytes of memory (%s)\n", size, strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	return ret;
+}
+
+static void *ecalloc(const size_t nmemb, const size_t size)
+{
+	void *ret = calloc(nmemb, size);
+
+	count_alloc();
+	if (unlikely(!ret)) {
+		fprintf(stderr, "Error: Failed to allocate %zu bytes of memory (%s)\n", nmemb * size, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return ret;
+}
+
+static void htable_init(struct htable *h, unsigned long size_hint)
+{
+	unsigned long size = 16;
+
+	while (size < size_hint)
+		size <<= 1;
+
+	h->buckets = ecalloc(size, sizeof(struct hnode *));
+	h->mask = size - 1;
+	h->count = 0;
+}
+
+static inline struct hnode *htable_bucket(const struct htable *h, unsigned long hash)
+{
+	return h->buckets[hash & h->mask];
+}
+
+static void htable_add(struct htable *h, struct hnode *n, unsigned long hash)
+{
+	struct hnode **b;
+
+	/* Keep the chains short, double the table if necessary */
+	if (h->count > h->mask) {
+		unsigned long i, size = (h->mask + 1) << 1;
+		struct hnode **buckets = ecalloc(size, sizeof(struct hnode *));
+
+		for (i = 0; i <= h->mask; i++) {
+			struct hnode *tmp, *next;
+
+			for (tmp = h->buckets[i]; tmp; tmp = next) {
+				next = tmp->next;
+				tmp->next = buckets[tmp->hash & (size - 1)];
+				buckets[tmp->hash & (size - 1)] = tmp;
+			}
+		}
+
+		free(h->buckets);
+		h->buckets = buckets;
+		h->mask = size - 1;
+	}
+
+	n->hash = hash;
+	b = &h->buckets[hash & h->mask];
+	n->next = *b;
+	*b = n;
+	h->count++;
+}
+
+static void htable_del(struct htable *h, struct hnode *n)
+{
+	struct hnode **p;
+
+	for (p = &h->buckets[n->hash & h->mask]; *p; p = &(*p)->next) {
+		if (*p == n) {
+			*p = n->next;
+			n->next = NULL;
+			h->count--;
+			return;
+		}
+	}
+}
+
+/*
+ * Get the process wide I/O buffer, making sure it holds at least size bytes.
+ * It is sized at startup for the largest block size of the tailed files, so
+ * it doesn't need to grow anymore once we're following files. The contents are
+ * not preserved if it needs to grow.
+ */
+static char *io_buffer(size_t size)
+{
+	void *buf = MAP_FAILED;
+
+	if (likely(size <= io_buf.size))
+		return io_buf.buf;
+
+	if (io_buf.buf)
+		munmap(io_buf.buf, io_buf.size);
+
+	if (hugepages) {
+		size = (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+		buf = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED)
+			dprintf("D: No huge pages available (%s)\n", strerror(errno));
+	}
+
+	if (buf == MAP_FAILED) {
+		buf = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (unlikely(buf == MAP_FAILED)) {
+			fprintf(stderr, "Error: Failed to allocate %zu bytes of memory (%s)\n", size, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		/* Transparent huge pages are the next best thing */
+		if (hugepages)
+			madvise(buf, size, MADV_HUGEPAGE);
+	}
+
+	count_alloc();
+	io_buf.buf = buf;
+	io_buf.size = size;
+
+	return io_buf.buf;
+}
+
 static inline int xargmatch(const char *context, const char *arg)
 {
 	size_t ctx_len = strlen(context);
@@ -104,612 +432,4469 @@ static void __noreturn usage(const int status)
 			"        --retry      keep trying to open a file even if it is not\n"
 			"                     accessible at start or becomes inaccessible\n"
 			"                     later; useful when following by name\n"
+			"        --backlog-policy=POLICY\n"
+			"                     what to do about followed files falling more than\n"
+			"                     --max-backlog behind a slow reader of the output:\n"
+			"                     block (default), drop-oldest or skip\n"
 			"  -c N, --bytes=N    output the last N bytes\n"
+			"        --coalesce[=DELAY]\n"
+			"                     with -f, let events pile up for DELAY ms and\n"
+			"                     handle them at once (default: 5)\n"
+			"        --direct     like --nocache, but read with O_DIRECT where\n"
+			"                     the file system supports it\n"
+			"        --exclude=PATTERN\n"
+			"                     don't output lines matching PATTERN\n"
 			"  -f,   --follow[={descriptor|name}]\n"
 			"                     output as the file grows (default: descriptor)\n"
 			"  -F                 same as --follow=name --retry\n"
+			"        --glob=PATTERN\n"
+			"                     tail the files matching PATTERN (or in directory\n"
+			"                     PATTERN), with -f also files appearing later\n"
+			"        --hugepages  back the I/O buffer with huge pages\n"
+			"        --line-index[=DIR]\n"
+			"                     keep an index of line offsets for +N next to\n"
+			"                     each file or in DIR\n"
 			"  -n N, --lines=N    output the last N lines (default: %d)\n"
+			"        --match=PATTERN\n"
+			"                     only output lines matching PATTERN\n"
+			"        --max-backlog=SIZE\n"
+			"                     bytes a followed file may fall behind (default: 16M)\n"
+			"        --nocache    read ahead what is about to be scanned and drop\n"
+			"                     what was read from the page cache\n"
+			"        --parallel[=N]\n"
+			"                     count lines for +N in large files using N threads\n"
+			"                     (default: number of CPUs)\n"
+			"        --pid=PID    with -f, terminate after process ID, PID dies\n"
+			"        --prefetch   open and read ahead all files before tailing them\n"
 			"  -q,   --quiet, --slient\n"
 			"                     never print headers with file names\n"
+			"        --since=TIME output starting with the first line with a\n"
+			"                     timestamp of at least TIME\n"
+			"        --state-file=FILE\n"
+			"                     record how far each file was output in FILE and\n"
+			"                     resume from there on the next start\n"
+			"        --stats-file=FILE\n"
+			"                     with -f, write statistics to FILE every second\n"
+			"                     (Prometheus text format)\n"
+			"        --time-format=FORMAT\n"
+			"                     strptime(3) format of the timestamps at the\n"
+			"                     beginning of lines (default: %s)\n"
+			"        --until=TIME stop before the first line with a timestamp\n"
+			"                     later than TIME\n"
 			"  -v,   --verbose    always print headers with file names\n"
 			"  -h,   --help       show this help and exit\n"
 			"  -V,   --version    show version and exit\n\n"
 			"If the first character of N (the number of bytes or lines) is a `+',\n"
 			"begin printing with the Nth item from the start of each file, otherwise,\n"
-			"print the last N items in the file.\n", PROGRAM_NAME, DEFAULT_N_LINES);
+			"print the last N items in the file.\n", PROGRAM_NAME, DEFAULT_N_LINES,
+			DEFAULT_TIME_FORMAT);
 
 	exit(status);
 }
 
+/* Parse a size with an optional K, M or G suffix */
+static int parse_size(const char *s, off_t *size)
+{
+	char *end;
+	unsigned long long n;
+
+	if (!is_digit(*s))
+		return -1;
+
+	errno = 0;
+	n = strtoull(s, &end, 10);
+	switch (*end) {
+	case 'G':
+		n *= 1024;
+		/* fall through */
+	case 'M':
+		n *= 1024;
+		/* fall through */
+	case 'K':
+		n *= 1024;
+		end++;
+		break;
+	}
+
+	if (errno || *end || n > INT64_MAX)
+		return -1;
+
+	*size = n;
+	return 0;
+}
+
+/* Parse the DELAY given to --coalesce, in (fractional) milliseconds */
+static int parse_coalesce(const char *s)
+{
+	char *end;
+	double ms;
+
+	coalesce_delay = COALESCE_DELAY;
+	if (!s)
+		return 0;
+
+	if (!is_digit(*s))
+		return -1;
+	ms = strtod(s, &end);
+	if (*end || ms > 60000)
+		return -1;
+	coalesce_delay = ms * 1000000;
+
+	return 0;
+}
+
 static inline void setup_file(struct file_struct *f)
 {
+	f->dir = NULL;
+	f->ready = 0;
+	f->skipped = 0;
+	f->cut = 0;
+	f->dev = 0;
+	f->ino = 0;
+	f->glob = 0;
+	f->since = 0;
+	f->dropped = 0;
+	f->sparse = 0;
+	memset(&f->stats, 0, sizeof(f->stats));
+	f->carry.buf = NULL;
+	f->carry.len = f->carry.size = 0;
 	f->fd = f->i_watch = -1;
 	f->size = 0;
 	f->blksize = BUFSIZ;
+	f->mode = 0;
 	f->ignore = 0;
 }
 
-static void ignore_file(struct file_struct *f)
+/* Watch descriptors are allocated sequentially by the kernel, so they can be
+ * used as hash values directly */
+static int add_watch(struct file_struct *f)
 {
-	if (f->fd != -1) {
-		close(f->fd);
-		f->fd = -1;
+	f->i_watch = inotify_add_watch(ifd, f->name, INOTAIL_WATCH_MASK);
+	if (f->i_watch >= 0)
+		htable_add(&wd_table, &f->wd_node, f->i_watch);
+
+	return f->i_watch;
+}
+
+static void rm_watch(struct file_struct *f)
+{
+	if (f->i_watch < 0)
+		return;
+
+	htable_del(&wd_table, &f->wd_node);
+	inotify_rm_watch(ifd, f->i_watch);
+	f->i_watch = -1;
+}
+
+static struct file_struct *file_by_wd(int wd)
+{
+	struct hnode *n;
+
+	for (n = htable_bucket(&wd_table, wd); n; n = n->next) {
+		struct file_struct *f = container_of(n, struct file_struct, wd_node);
+
+		if (f->i_watch == wd)
+			return f;
 	}
-	if (!f->ignore) {
-		f->ignore = 1;
-		++n_ignored;
+
+	return NULL;
+}
+
+/* FNV-1a */
+static unsigned long hash_str(const char *s)
+{
+	unsigned long hash = 2166136261UL;
+
+	while (*s) {
+		hash ^= (unsigned char) *s++;
+		hash *= 16777619UL;
 	}
+
+	return hash;
 }
 
-static inline char *pretty_name(char *filename)
+static inline unsigned long name_hash(const struct dir_struct *d, const char *name)
 {
-	return (strcmp(filename, "-") == 0) ? "standard input" : filename;
+	return hash_str(name) ^ ((unsigned long) d->wd * 0x9e3779b1UL);
 }
 
-static void write_header(char *filename)
+static struct dir_struct *dir_by_wd(int wd)
 {
-	static unsigned short first_file = 1;
-	static char *last = NULL;
+	struct hnode *n;
 
-	if (last != filename) {
-		fprintf(stdout, "%s==> %s <==\n", (first_file ? "" : "\n"), pretty_name(filename));
-		fflush(stdout);		/* Make sure the header is printed before the content */
+	for (n = htable_bucket(&dir_wd_table, wd); n; n = n->next) {
+		struct dir_struct *d = container_of(n, struct dir_struct, wd_node);
+
+		if (d->wd == wd)
+			return d;
 	}
 
-	first_file = 0;
-	last = filename;
+	return NULL;
 }
 
-static off_t lines_to_offset_from_end(struct file_struct *f, unsigned long n_lines)
+static struct dir_struct *dir_by_path(const char *path)
 {
-	off_t offset = f->size;
-	char *buf = emalloc(f->blksize);
+	unsigned long hash = hash_str(path);
+	struct hnode *n;
 
-	/* We also count the last \n */
-	++n_lines;
+	for (n = htable_bucket(&dir_path_table, hash); n; n = n->next) {
+		struct dir_struct *d = container_of(n, struct dir_struct, path_node);
 
-	while (offset > 0 && n_lines > 0) {
-		int i;
-		ssize_t rc, block_size = f->blksize;	/* Size of the current block we're reading */
+		if (n->hash == hash && strcmp(d->path, path) == 0)
+			return d;
+	}
 
-		if (offset < block_size)
-			block_size = offset;
+	return NULL;
+}
 
-		/* Start of current block */
-		offset -= block_size;
+/* Iterate over the files named 'name' followed in directory d */
+static struct file_struct *next_file_by_name(const struct dir_struct *d, const char *name,
+					     struct file_struct *prev)
+{
+	struct hnode *n;
 
-		if (lseek(f->fd, offset, SEEK_SET) == (off_t) -1) {
-			fprintf(stderr, "Error: Could not seek in file '%s' (%s)\n", f->name, strerror(errno));
-			free(buf);
-			return -1;
-		}
+	if (prev)
+		n = prev->name_node.next;
+	else
+		n = htable_bucket(&name_table, name_hash(d, name));
 
-		rc = read(f->fd, buf, block_size);
-		if (unlikely(rc < 0)) {
-			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
-			free(buf);
-			return -1;
+	for (; n; n = n->next) {
+		struct file_struct *f = container_of(n, struct file_struct, name_node);
+
+		if (f->dir == d && strcmp(f->base, name) == 0)
+			return f;
+	}
+
+	return NULL;
+}
+
+/* Get a reference on the watched directory at path, setting up the watch if
+ * necessary. Takes over path. */
+static struct dir_struct *get_dir(char *path)
+{
+	struct dir_struct *d = dir_by_path(path);
+
+	if (!d) {
+		int wd = inotify_add_watch(ifd, path, INOTAIL_DIR_WATCH_MASK);
+
+		if (wd < 0) {
+			fprintf(stderr, "Error: Could not create inotify watch on directory '%s' (%s)\n",
+					path, strerror(errno));
+			free(path);
+			return NULL;
 		}
 
-		for (i = block_size - 1; i > 0; i--) {
-			if (buf[i] == '\n') {
-				if (--n_lines == 0) {
-					free(buf);
-					return offset + i + 1; /* We don't want the first \n */
-				}
-			}
+		/* Same directory under a different path? */
+		d = dir_by_wd(wd);
+		if (!d) {
+			d = emalloc(sizeof(struct dir_struct));
+			d->path = path;
+			d->wd = wd;
+			d->refs = 0;
+			htable_add(&dir_wd_table, &d->wd_node, wd);
+			htable_add(&dir_path_table, &d->path_node, hash_str(path));
+			path = NULL;
 		}
 	}
+	free(path);
 
-	free(buf);
-	return offset;
+	d->refs++;
+	return d;
 }
 
-static off_t lines_to_offset_from_begin(struct file_struct *f, unsigned long n_lines)
+static void put_dir(struct dir_struct *d)
 {
-	char *buf;
-	off_t offset = 0;
+	if (--d->refs == 0) {
+		htable_del(&dir_wd_table, &d->wd_node);
+		htable_del(&dir_path_table, &d->path_node);
+		inotify_rm_watch(ifd, d->wd);
+		free(d->path);
+		free(d);
+	}
+}
 
-	/* tail everything for 'inotail -n +0' */
-	if (n_lines == 0)
-		return 0;
+/*
+ * Follow f by name through a watch on its containing directory. The watch is
+ * shared by all files followed in the same directory, which lets us see the
+ * file being moved away, deleted and recreated under the same name.
+ */
+static int attach_dir(struct file_struct *f)
+{
+	const char *slash = strrchr(f->name, '/');
+	struct dir_struct *d;
+	char *path;
+
+	if (!slash)
+		path = strdup(".");
+	else if (slash == f->name)
+		path = strdup("/");
+	else
+		path = strndup(f->name, slash - f->name);
+	if (unlikely(!path)) {
+		fprintf(stderr, "Error: Failed to allocate memory (%s)\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	count_alloc();
 
-	n_lines--;
-	buf = emalloc(f->blksize);
+	f->base = slash ? slash + 1 : f->name;
 
-	while (offset <= f->size && n_lines > 0) {
-		int i;
-		ssize_t rc, block_size = f->blksize;
+	d = get_dir(path);
+	if (!d)
+		return -1;
 
-		if (lseek(f->fd, offset, SEEK_SET) == (off_t) -1) {
-			fprintf(stderr, "Error: Could not seek in file '%s' (%s)\n", f->name, strerror(errno));
-			free(buf);
-			return -1;
-		}
+	f->dir = d;
+	htable_add(&name_table, &f->name_node, name_hash(d, f->base));
 
-		rc = read(f->fd, buf, block_size);
-		if (unlikely(rc < 0)) {
-			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
-			free(buf);
-			return -1;
-		} else if (rc < block_size)
-			block_size = rc;
-
-		for (i = 0; i < block_size; i++) {
-			if (buf[i] == '\n') {
-				if (--n_lines == 0) {
-					free(buf);
-					return offset + i + 1;
-				}
-			}
-		}
+	return 0;
+}
 
-		offset += block_size;
-	}
+static void detach_dir(struct file_struct *f)
+{
+	struct dir_struct *d = f->dir;
 
-	free(buf);
-	return offset;
+	if (!d)
+		return;
+
+	htable_del(&name_table, &f->name_node);
+	f->dir = NULL;
+	put_dir(d);
 }
 
-static off_t lines_to_offset(struct file_struct *f, unsigned long n_lines)
+static void ignore_file(struct file_struct *f)
 {
-	if (from_begin)
-		return lines_to_offset_from_begin(f, n_lines);
-	else
-		return lines_to_offset_from_end(f, n_lines);
+	/* Events for the file are of no interest anymore */
+	rm_watch(f);
+	detach_dir(f);
+
+	if (f->fd != -1) {
+		close(f->fd);
+		f->fd = -1;
+	}
+	if (!f->ignore) {
+		f->ignore = 1;
+		++n_ignored;
+	}
 }
 
-static off_t bytes_to_offset(struct file_struct *f, unsigned long n_bytes)
+/* Add a file to be tailed to the table */
+static struct file_struct *add_file(char *name)
 {
-	off_t offset = 0;
+	struct file_struct *f = emalloc(sizeof(struct file_struct));
 
-	/* tail everything for 'inotail -c +0' */
-	if (from_begin) {
-		if (n_bytes > 0)
-			offset = (off_t) n_bytes - 1;
-	} else if ((off_t) n_bytes < f->size)
-		offset = f->size - (off_t) n_bytes;
+	if (n_files == max_files) {
+		max_files = max_files ? max_files * 2 : 16;
+		files = erealloc(files, max_files * sizeof(struct file_struct *));
+	}
 
-	/* Otherwise offset stays 0 (begin of file) */
+	f->name = name;
+	setup_file(f);
+	f->idx = n_files;
+	files[n_files++] = f;
 
-	return offset;
+	return f;
 }
 
-static int tail_pipe_from_begin(struct file_struct *f, unsigned long n_units, const char mode)
+static void free_file(struct file_struct *f)
 {
-	int bytes_read = 0;
-	char buf[BUFSIZ];
+	free(f->carry.buf);
+	if (f->glob)
+		free(f->name);
+	free(f);
+}
 
-	if (n_units)
-		n_units--;
+/* Forget about f, which is not in the table of files afterwards anymore */
+static void remove_file(struct file_struct *f)
+{
+	ignore_file(f);
+	n_ignored--;
 
-	while (n_units > 0) {
-		if ((bytes_read = read(f->fd, buf, BUFSIZ)) <= 0) {
-			/* Interrupted by a signal, retry reading */
-			if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN))
-				continue;
-			else
-				return bytes_read;
-		}
+	files[f->idx] = files[--n_files];
+	files[f->idx]->idx = f->idx;
+	f->idx = -1;
 
-		if (mode == M_LINES) {
-			int i;
-			ssize_t block_size = BUFSIZ;
+	/* Freed by run_ready() once it gets its turn */
+	if (!f->ready)
+		free_file(f);
+}
 
-			if (bytes_read < BUFSIZ)
-				block_size = bytes_read;
+/* Anything left to follow? */
+static inline int following(void)
+{
+	return n_ignored < n_files || n_globs > 0;
+}
 
-			for (i = 0; i < block_size; i++) {
-				if (buf[i] == '\n') {
-					if (--n_units == 0)
-						break;
-				}
-			}
+static inline char *pretty_name(char *filename)
+{
+	return (strcmp(filename, "-") == 0) ? "standard input" : filename;
+}
 
-			/* Print remainder of the current block */
-			if (++i < block_size)
-				write(STDOUT_FILENO, &buf[i], bytes_read - i);
-		} else {
-			if ((unsigned long) bytes_read > n_units) {
-				write(STDOUT_FILENO, &buf[n_units], bytes_read - n_units);
-				bytes_read = n_units;
-			}
+/*
+ * Newline scanners
+ *
+ * rscan_nl() scans buf[0..len) backwards for '\n', fscan_nl() forwards. Both
+ * decrement *n_lines for every newline found. If *n_lines drops to zero, the
+ * index of the newline where this happened is returned, otherwise -1 is
+ * returned and *n_lines holds the number of newlines still to be found in the
+ * data preceding (rscan_nl) or following (fscan_nl) buf.
+ */
+typedef ssize_t (*scan_fn)(const char *buf, size_t len, unsigned long *n_lines);
 
-			n_units -= bytes_read;
-		}
+static ssize_t rscan_nl_scalar(const char *buf, size_t len, unsigned long *n_lines)
+{
+	size_t i = len;
+
+	while (i-- > 0) {
+		if (buf[i] == '\n' && --(*n_lines) == 0)
+			return i;
 	}
 
-	while ((bytes_read = read(f->fd, buf, BUFSIZ)) > 0)
-		write(STDOUT_FILENO, buf, (size_t) bytes_read);
+	return -1;
+}
+
+static ssize_t fscan_nl_scalar(const char *buf, size_t len, unsigned long *n_lines)
+{
+	const char *p = buf, *end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		if (--(*n_lines) == 0)
+			return p - buf;
+		++p;
+	}
+
+	return -1;
+}
+
+/* Find the first occurrence of pat in buf, returns NULL if there is none */
+typedef const char *(*search_fn)(const char *buf, size_t len, const char *pat, size_t pat_len);
+
+static const char *find_literal_scalar(const char *buf, size_t len, const char *pat, size_t pat_len)
+{
+	return memmem(buf, len, pat, pat_len);
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * Consume the newlines in a 64 byte block starting at buf[i], given as bit mask
+ * (bit k set means buf[i + k] == '\n'). Returns the index of the newline which
+ * made *n_lines drop to zero or -1 if there are not enough newlines in the
+ * block.
+ */
+static inline ssize_t rscan_mask64(unsigned long long mask, size_t i, unsigned long *n_lines)
+{
+	unsigned long cnt = __builtin_popcountll(mask);
+
+	if (cnt < *n_lines) {
+		*n_lines -= cnt;
+		return -1;
+	}
+
+	/* Drop the (*n_lines - 1) highest newlines, the next one is ours */
+	while (--(*n_lines) > 0)
+		mask &= ~(1ULL << (63 - __builtin_clzll(mask)));
+
+	return i + 63 - __builtin_clzll(mask);
+}
+
+static inline ssize_t fscan_mask64(unsigned long long mask, size_t i, unsigned long *n_lines)
+{
+	unsigned long cnt = __builtin_popcountll(mask);
+
+	if (cnt < *n_lines) {
+		*n_lines -= cnt;
+		return -1;
+	}
+
+	/* Drop the (*n_lines - 1) lowest newlines, the next one is ours */
+	while (--(*n_lines) > 0)
+		mask &= mask - 1;
+
+	return i + __builtin_ctzll(mask);
+}
+
+/* Bit masks of the bytes equal to c in 64 byte blocks. SSE2 is part of the
+ * x86_64 baseline, so it needs no target attribute. */
+static inline unsigned long long eq_mask64_sse2(const char *p, char c)
+{
+	const __m128i v = _mm_set1_epi8(c);
+
+	return (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), v))
+		| (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 16)), v)) << 16
+		| (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 32)), v)) << 32
+		| (unsigned long long) (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 48)), v)) << 48;
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline unsigned long long eq_mask64_avx2(const char *p, char c)
+{
+	const __m256i v = _mm256_set1_epi8(c);
+
+	return (unsigned long long) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), v))
+		| (unsigned long long) (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 32)), v)) << 32;
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static inline unsigned long long eq_mask64_avx512(const char *p, char c)
+{
+	return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) p), _mm512_set1_epi8(c));
+}
+
+/* Define the backward and forward scanners for one instruction set */
+#define DEFINE_NL_SCANNERS(isa, target)						\
+target static ssize_t rscan_nl_##isa(const char *buf, size_t len,		\
+				     unsigned long *n_lines)			\
+{										\
+	size_t i = len;								\
+										\
+	while (i >= 64) {							\
+		unsigned long long mask;					\
+		ssize_t ret;							\
+										\
+		i -= 64;							\
+		mask = eq_mask64_##isa(&buf[i], '\n');			\
+		/* Fast path for long lines: no newline in the block */	\
+		if (!mask)							\
+			continue;						\
+		if ((ret = rscan_mask64(mask, i, n_lines)) >= 0)		\
+			return ret;						\
+	}									\
+										\
+	return rscan_nl_scalar(buf, i, n_lines);				\
+}										\
+										\
+target static ssize_t fscan_nl_##isa(const char *buf, size_t len,		\
+				     unsigned long *n_lines)			\
+{										\
+	size_t i;								\
+	ssize_t ret;								\
+										\
+	for (i = 0; i + 64 <= len; i += 64) {					\
+		unsigned long long mask = eq_mask64_##isa(&buf[i], '\n');	\
+										\
+		if (mask && (ret = fscan_mask64(mask, i, n_lines)) >= 0)	\
+			return ret;						\
+	}									\
+										\
+	ret = fscan_nl_scalar(buf + i, len - i, n_lines);			\
+	return ret < 0 ? ret : (ssize_t) i + ret;				\
+}
+
+/*
+ * Define the literal search for one instruction set: candidate positions are
+ * those where both the first and the last byte of the pattern match, only
+ * these are compared in full.
+ */
+#define DEFINE_LITERAL_SEARCH(isa, target)					\
+target static const char *find_literal_##isa(const char *buf, size_t len,	\
+					     const char *pat, size_t pat_len)	\
+{										\
+	size_t i = 0;								\
+										\
+	if (pat_len == 0 || pat_len > len)					\
+		return find_literal_scalar(buf, len, pat, pat_len);		\
+										\
+	for (; i + pat_len - 1 + 64 <= len; i += 64) {				\
+		unsigned long long mask = eq_mask64_##isa(&buf[i], pat[0]) &	\
+			eq_mask64_##isa(&buf[i + pat_len - 1], pat[pat_len - 1]); \
+										\
+		while (mask) {							\
+			size_t j = i + __builtin_ctzll(mask);			\
+										\
+			if (pat_len <= 2 ||					\
+			    memcmp(&buf[j + 1], pat + 1, pat_len - 2) == 0)	\
+				return &buf[j];					\
+			mask &= mask - 1;					\
+		}								\
+	}									\
+										\
+	return find_literal_scalar(buf + i, len - i, pat, pat_len);		\
+}
+
+DEFINE_NL_SCANNERS(sse2, )
+DEFINE_NL_SCANNERS(avx2, __attribute__((target("avx2,popcnt"))))
+DEFINE_NL_SCANNERS(avx512, __attribute__((target("avx512f,avx512bw,popcnt"))))
+DEFINE_LITERAL_SEARCH(sse2, )
+DEFINE_LITERAL_SEARCH(avx2, __attribute__((target("avx2,popcnt"))))
+DEFINE_LITERAL_SEARCH(avx512, __attribute__((target("avx512f,avx512bw,popcnt"))))
+#endif /* HAVE_X86_SIMD */
+
+/* Newline scanners and literal search for the current CPU, set up by
+ * init_scanners() */
+static scan_fn rscan_nl = rscan_nl_scalar;
+static scan_fn fscan_nl = fscan_nl_scalar;
+static search_fn find_literal = find_literal_scalar;
+
+static void init_scanners(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512bw")) {
+		rscan_nl = rscan_nl_avx512;
+		fscan_nl = fscan_nl_avx512;
+		find_literal = find_literal_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		rscan_nl = rscan_nl_avx2;
+		fscan_nl = fscan_nl_avx2;
+		find_literal = find_literal_avx2;
+	} else {
+		rscan_nl = rscan_nl_sse2;
+		fscan_nl = fscan_nl_sse2;
+		find_literal = find_literal_sse2;
+	}
+#endif
+	dprintf("D: Using %s newline scanners\n",
+		rscan_nl == rscan_nl_scalar ? "scalar" :
+#ifdef HAVE_X86_SIMD
+		rscan_nl == rscan_nl_avx512 ? "AVX-512" :
+		rscan_nl == rscan_nl_avx2 ? "AVX2" : "SSE2"
+#else
+		"unknown"
+#endif
+		);
+}
+
+/* Number of newlines in buf[0..len) */
+static inline unsigned long count_nl(const char *buf, size_t len)
+{
+	unsigned long n = ULONG_MAX;
+
+	/* The scanner never finds ULONG_MAX newlines, but it counts them for
+	 * us */
+	fscan_nl(buf, len, &n);
+
+	return ULONG_MAX - n;
+}
+
+/* Size of the window to read at once when scanning a file, a multiple of the
+ * file's block size */
+static inline size_t scan_window(const struct file_struct *f)
+{
+	size_t blksize = f->blksize;
+
+	if (blksize >= SCAN_WINDOW)
+		return blksize;
+
+	return SCAN_WINDOW - SCAN_WINDOW % blksize;
+}
+
+/*
+ * Statistics
+ *
+ * Counters are plain increments of the global stats and the file_stats of each
+ * file, cheap enough to be always on. The output latency is measured from the
+ * time the inotify event announcing new data was read to when the data has
+ * been written to stdout, recorded once per file catching up or batch of
+ * queued output written.
+ */
+static inline unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Record the output of data announced at time start */
+static void stats_latency(unsigned long long start)
+{
+	unsigned long long ns = now_ns() - start;
+	int i = 0;
+
+	while (i < LATENCY_BUCKETS && ns > (1000ULL << i))
+		i++;
+	stats.latency[i]++;
+	stats.latency_sum += ns;
+	stats.latency_count++;
+}
+
+static inline ssize_t read_counted(int fd, void *buf, size_t len)
+{
+	stats.syscalls++;
+	return read(fd, buf, len);
+}
+
+/* Wait for a non-blocking fd to become writable again */
+static int wait_writable(int fd)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	return 0;
+}
+
+/* Write all of buf to fd, returns the number of bytes written or -1 on errors */
+static ssize_t write_all(int fd, const char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rc = write(fd, buf + done, len - done);
+
+		stats.syscalls++;
+		if (unlikely(rc < 0)) {
+			if (errno == EINTR || (errno == EAGAIN && wait_writable(fd) == 0))
+				continue;
+			return done ? (ssize_t) done : -1;
+		}
+		if (fd == STDOUT_FILENO)
+			stats.bytes_written += rc;
+		done += rc;
+	}
+
+	return done;
+}
+
+/* Write all of iov to fd, returns 0 on success or -1 on errors. iov gets
+ * modified in the process. */
+static int writev_all(int fd, struct iovec *iov, int n_iov)
+{
+	while (n_iov > 0) {
+		ssize_t rc = writev(fd, iov, n_iov);
+
+		stats.syscalls++;
+		if (unlikely(rc < 0)) {
+			if (errno == EINTR || (errno == EAGAIN && wait_writable(fd) == 0))
+				continue;
+			return -1;
+		}
+		if (fd == STDOUT_FILENO)
+			stats.bytes_written += rc;
+
+		/* Skip what has been written, adjust partially written part */
+		while (n_iov > 0 && (size_t) rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			n_iov--;
+		}
+		if (n_iov > 0) {
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Output queue
+ *
+ * When following several files, their output is collected in out and written
+ * in one go once OUTPUT_FLUSH_SIZE bytes are queued or OUTPUT_FLUSH_DELAY
+ * after the first of them was queued, whatever comes first. Only complete
+ * lines get queued, each preceded by the header of its file if it comes from
+ * a different file than the previous one, so lines of different files never
+ * get mixed up.
+ *
+ * While following, a pipe or socket on stdout is made non-blocking. If it is
+ * full, whatever could not be written stays in out and stdout is stalled until
+ * epoll reports it writable again. Followed files are not read in the
+ * meantime, see follow_file().
+ */
+static void out_stall(int stalled)
+{
+	struct epoll_event ev;
+
+	out_stalled = stalled;
+	ev.events = stalled ? EPOLLOUT : 0;
+	ev.data.ptr = &stdout_src;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, stdout_src.fd, &ev) < 0)
+		dprintf("D: Could not watch stdout (%s)\n", strerror(errno));
+}
+
+/* Write as much of buf to stdout as it takes without blocking, unless
+ * out_blocking is set. Returns the number of bytes done with. */
+static size_t out_try_write(const char *buf, size_t len)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t rc = write(STDOUT_FILENO, buf + done, len - done);
+
+		stats.syscalls++;
+		if (rc >= 0) {
+			stats.bytes_written += rc;
+			done += rc;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN && !out_blocking) {
+			if (!out_stalled)
+				out_stall(1);
+			return done;
+		}
+		if (errno == EAGAIN && wait_writable(STDOUT_FILENO) == 0)
+			continue;
+
+		/* e.g. when writing to a pipe which gets closed, the data is
+		 * lost either way */
+		dprintf("D: Could not write to stdout (%s)\n", strerror(errno));
+		return len;
+	}
+
+	return done;
+}
+
+static void out_flush(void)
+{
+	size_t done = out_try_write(out.buf, out.len);
+
+	out.len -= done;
+	if (out.len > 0)
+		memmove(out.buf, out.buf + done, out.len);
+	else if (out_since) {
+		stats_latency(out_since);
+		out_since = 0;
+	}
+}
+
+static void out_append(const char *buf, size_t len)
+{
+	if (len > out.size - out.len && !out_stalled) {
+		out_flush();
+
+		/* Too big to be worth collecting */
+		if (len >= out.size && !out_stalled) {
+			size_t done = out_try_write(buf, len);
+
+			buf += done;
+			len -= done;
+			if (len == 0)
+				return;
+		}
+	}
+
+	/* Keep what a stalled stdout does not take for now */
+	if (len > out.size - out.len) {
+		while (len > out.size - out.len)
+			out.size = out.size ? out.size * 2 : OUTPUT_FLUSH_SIZE;
+		out.buf = erealloc(out.buf, out.size);
+	}
+
+	/* Start the clock for the data queued first */
+	if (out.len == 0 && flush_src.fd >= 0) {
+		struct itimerspec its = { { 0, 0 }, { 0, OUTPUT_FLUSH_DELAY } };
+
+		timerfd_settime(flush_src.fd, 0, &its, NULL);
+	}
+
+	memcpy(out.buf + out.len, buf, len);
+	out.len += len;
+}
+
+/* Write buf to stdout after whatever is still queued, returns -1 on errors */
+static int out_write(const char *buf, size_t len)
+{
+	if (out_blocking && out.len == 0)
+		return write_all(STDOUT_FILENO, buf, len) < 0 ? -1 : 0;
+
+	out_append(buf, len);
+	if (!out_stalled)
+		out_flush();
+
+	return 0;
+}
+
+static void write_header(char *filename)
+{
+	static unsigned short first_file = 1;
+	static char *last = NULL;
+	char hdr[PATH_MAX + 32];
+
+	if (last != filename) {
+		int len = snprintf(hdr, sizeof(hdr), "%s==> %s <==\n", (first_file ? "" : "\n"),
+				   pretty_name(filename));
+
+		if (len >= (int) sizeof(hdr))
+			len = sizeof(hdr) - 1;
+		if (line_atomic)
+			out_append(hdr, len);
+		else
+			out_write(hdr, len);
+	}
+
+	first_file = 0;
+	last = filename;
+}
+
+/* Queue the runs of complete lines from file arg */
+static int queue_sink(void *arg, struct iovec *iov, int n_iov)
+{
+	struct file_struct *f = arg;
+	int i;
+
+	if (verbose)
+		write_header(f->name);
+
+	for (i = 0; i < n_iov; i++)
+		out_append(iov[i].iov_base, iov[i].iov_len);
+
+	return 0;
+}
+
+/* Choose the cheapest way to copy file data to stdout based on its type */
+static void setup_output(void)
+{
+	struct stat finfo;
+	int flags;
+
+	if (fstat(STDOUT_FILENO, &finfo) < 0)
+		return;
+
+	/* The kernel refuses to splice/copy into files opened for appending */
+	flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (flags < 0 || (flags & O_APPEND))
+		return;
+
+	if (S_ISFIFO(finfo.st_mode))
+		copy_method = COPY_SPLICE;
+	else if (S_ISREG(finfo.st_mode))
+		copy_method = COPY_FILE_RANGE;
+	else if (S_ISSOCK(finfo.st_mode))
+		copy_method = COPY_SENDFILE;
+	/* Terminals and everything else get plain read()/write() */
+
+	dprintf("D: Using copy method %d for stdout\n", copy_method);
+}
+
+/* How much to copy at most in one go if max bytes are to be copied */
+static inline size_t copy_len(off_t max, off_t copied, size_t chunk)
+{
+	if (max < 0 || max - copied > (off_t) chunk)
+		return chunk;
+	return max - copied;
+}
+
+/*
+ * Line filters
+ *
+ * With --match and --exclude, only complete lines matching any --match pattern
+ * (if given) and no --exclude pattern are output. Patterns without regular
+ * expression metacharacters are searched for literally using find_literal(),
+ * all others are POSIX extended regular expressions.
+ */
+static void add_filter(struct filter **list, const char *pattern)
+{
+	struct filter *flt = emalloc(sizeof(struct filter));
+	int err;
+
+	flt->pattern = pattern;
+	flt->len = strlen(pattern);
+	flt->is_regex = strpbrk(pattern, ".[]()*+?{}|^$\\") != NULL;
+	if (flt->is_regex && (err = regcomp(&flt->re, pattern, REG_EXTENDED|REG_NOSUB)) != 0) {
+		char msg[128];
+
+		regerror(err, &flt->re, msg, sizeof(msg));
+		fprintf(stderr, "Error: Invalid pattern '%s' (%s)\n", pattern, msg);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Patterns spanning lines can't be found by searching whole buffers */
+	if (list == &match_filters && (flt->is_regex || memchr(pattern, '\n', flt->len)))
+		literal_matches = 0;
+
+	flt->next = *list;
+	*list = flt;
+	filtering = 1;
+}
+
+static inline int filter_hit(struct filter *flt, const char *line, size_t len)
+{
+	regmatch_t m;
+
+	if (!flt->is_regex)
+		return find_literal(line, len, flt->pattern, flt->len) != NULL;
+
+	/* Match the line in place rather than copying it to terminate it */
+	m.rm_so = 0;
+	m.rm_eo = len;
+	return regexec(&flt->re, line, 1, &m, REG_STARTEND) == 0;
+}
+
+static int line_excluded(const char *line, size_t len)
+{
+	struct filter *flt;
+
+	for (flt = exclude_filters; flt; flt = flt->next)
+		if (filter_hit(flt, line, len))
+			return 1;
+
+	return 0;
+}
+
+/* Does line (without its newline) pass the filters? */
+static int line_matches(const char *line, size_t len)
+{
+	struct filter *flt;
+
+	if (line_excluded(line, len))
+		return 0;
+
+	if (!match_filters)
+		return 1;
+
+	for (flt = match_filters; flt; flt = flt->next)
+		if (filter_hit(flt, line, len))
+			return 1;
+
+	return 0;
+}
+
+static void line_buf_append(struct line_buf *lb, const char *buf, size_t len)
+{
+	if (lb->len + len > lb->size) {
+		lb->size = lb->size ? lb->size : 128;
+		while (lb->len + len > lb->size)
+			lb->size *= 2;
+		lb->buf = erealloc(lb->buf, lb->size);
+	}
+
+	memcpy(lb->buf + lb->len, buf, len);
+	lb->len += len;
+}
+
+/* Add line to the runs of matching lines in iov, passing them to sink once iov
+ * is full. Adjacent lines are merged into one run. */
+static int add_run(struct iovec *iov, int *n_iov, const char *line, size_t len,
+		   line_sink sink, void *arg)
+{
+	if (*n_iov > 0 && (char *) iov[*n_iov - 1].iov_base + iov[*n_iov - 1].iov_len == line) {
+		iov[*n_iov - 1].iov_len += len;
+		return 0;
+	}
+
+	if (*n_iov == FILTER_IOV) {
+		if (sink(arg, iov, *n_iov) < 0)
+			return -1;
+		*n_iov = 0;
+	}
+
+	iov[*n_iov].iov_base = (char *) line;
+	iov[*n_iov].iov_len = len;
+	(*n_iov)++;
+
+	return 0;
+}
+
+/* Add the lines in [p, end), which end with a newline, containing one of the
+ * literal match_filters and no exclude_filters to iov */
+static int filter_literal(const char *p, const char *end, struct iovec *iov, int *n_iov,
+			  line_sink sink, void *arg)
+{
+	struct filter *flt;
+
+	for (flt = match_filters; flt; flt = flt->next)
+		flt->hit = find_literal(p, end - p, flt->pattern, flt->len);
+
+	while (p < end) {
+		const char *hit = NULL, *start, *nl;
+
+		/* The earliest hit of all patterns, searching again for the
+		 * ones whose hit has been passed already */
+		for (flt = match_filters; flt; flt = flt->next) {
+			if (flt->hit && flt->hit < p)
+				flt->hit = find_literal(p, end - p, flt->pattern, flt->len);
+			if (flt->hit && (!hit || flt->hit < hit))
+				hit = flt->hit;
+		}
+		if (!hit)
+			break;
+
+		start = memrchr(p, '\n', hit - p);
+		start = start ? start + 1 : p;
+		nl = memchr(hit, '\n', end - hit);
+
+		if (!line_excluded(start, nl - start) &&
+		    add_run(iov, n_iov, start, nl + 1 - start, sink, arg) < 0)
+			return -1;
+		p = nl + 1;
+	}
+
+	return 0;
+}
+
+/* Treat the carried incomplete line as complete and pass it to sink if it
+ * matches */
+static int filter_flush(struct line_buf *carry, line_sink sink, void *arg)
+{
+	struct iovec iov;
+	int ret = 0;
+
+	if (carry->len > 0 && line_matches(carry->buf, carry->len)) {
+		iov.iov_base = carry->buf;
+		iov.iov_len = carry->len;
+		ret = sink(arg, &iov, 1);
+	}
+	carry->len = 0;
+
+	return ret;
+}
+
+/*
+ * Pass the complete lines in buf matching the filters to sink. An incomplete
+ * line at the end of buf is kept in carry and completed by the data of the next
+ * call, or output by filter_flush(), at the latest once it is max_backlog bytes
+ * long. Returns 0 on success or -1 if sink failed.
+ */
+static int filter_lines(struct line_buf *carry, const char *buf, size_t len,
+			line_sink sink, void *arg)
+{
+	struct iovec iov[FILTER_IOV];
+	const char *p = buf, *end = buf + len;
+	int n_iov = 0;
+
+	if (carry->len > 0) {
+		unsigned long n = 1;
+		ssize_t i = fscan_nl(buf, len, &n);
+
+		if (i < 0) {
+			line_buf_append(carry, buf, len);
+			goto out;
+		}
+
+		/* Completes the line from the last call, which is only reset
+		 * after being passed to sink */
+		line_buf_append(carry, buf, i + 1);
+		if (line_matches(carry->buf, carry->len - 1))
+			add_run(iov, &n_iov, carry->buf, carry->len, sink, arg);
+		p += i + 1;
+	}
+
+	if (!filtering) {
+		/* Just collecting complete lines */
+		const char *nl = memrchr(p, '\n', end - p);
+
+		if (nl) {
+			if (add_run(iov, &n_iov, p, nl + 1 - p, sink, arg) < 0)
+				return -1;
+			p = nl + 1;
+		}
+	} else if (match_filters && literal_matches) {
+		/* Search the patterns in all lines at once rather than line by
+		 * line, which is a lot faster if only few lines match */
+		const char *nl = memrchr(p, '\n', end - p);
+
+		if (nl) {
+			if (filter_literal(p, nl + 1, iov, &n_iov, sink, arg) < 0)
+				return -1;
+			p = nl + 1;
+		}
+	} else {
+		while (p < end) {
+			unsigned long n = 1;
+			ssize_t i = fscan_nl(p, end - p, &n);
+
+			if (i < 0)
+				break;
+			if (line_matches(p, i) && add_run(iov, &n_iov, p, i + 1, sink, arg) < 0)
+				return -1;
+			p += i + 1;
+		}
+	}
+
+	if (n_iov > 0 && sink(arg, iov, n_iov) < 0)
+		return -1;
+
+	carry->len = 0;
+	if (p < end)
+		line_buf_append(carry, p, end - p);
+out:
+	/* Don't wait forever for a writer to end the line, see --max-backlog */
+	if ((off_t) carry->len >= max_backlog)
+		return filter_flush(carry, sink, arg);
+
+	return 0;
+}
+
+static int stdout_sink(void *arg __attribute__((unused)), struct iovec *iov, int n_iov)
+{
+	int i;
+
+	if (out_blocking && out.len == 0)
+		return writev_all(STDOUT_FILENO, iov, n_iov);
+
+	for (i = 0; i < n_iov; i++)
+		out_append(iov[i].iov_base, iov[i].iov_len);
+	if (!out_stalled)
+		out_flush();
+
+	return 0;
+}
+
+/* Where copy_to_stdout() reads f from: at f->size, leaving the position of
+ * f->fd alone, unless f is a pipe (NULL) */
+static inline off_t *file_pos(const struct file_struct *f, off_t *pos)
+{
+	*pos = f->size;
+	return IS_PIPELIKE(f->mode) ? NULL : pos;
+}
+
+/* Read f with O_DIRECT from now on if its file system lets us, see --direct */
+static void direct_open(const struct file_struct *f)
+{
+	char path[64];
+	int fd;
+
+	/* Gets us the very same file, whatever its name points to by now */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+	fd = open(path, O_RDONLY|O_LARGEFILE|O_DIRECT);
+	if (fd < 0) {
+		dprintf("D: Not reading '%s' with O_DIRECT (%s)\n", f->name, strerror(errno));
+		return;
+	}
+
+	direct.f = f;
+	direct.fd = fd;
+}
+
+static void direct_close(void)
+{
+	if (direct.fd >= 0)
+		close(direct.fd);
+	direct.f = NULL;
+	direct.fd = -1;
+}
+
+/*
+ * pread() from f, around the page cache if f is read with O_DIRECT and buf, len
+ * and offset are aligned to DIRECT_ALIGN. Anything else, like the last bit of a
+ * file, is read through the page cache.
+ */
+static ssize_t file_read(const struct file_struct *f, char *buf, size_t len, off_t offset)
+{
+	if (direct.f == f && ((uintptr_t) buf | len | (size_t) offset) % DIRECT_ALIGN == 0) {
+		ssize_t rc = pread(direct.fd, buf, len, offset);
+
+		if (rc >= 0 || errno != EINVAL)
+			return rc;
+		/* The file system wants it aligned to more than that */
+		dprintf("D: Not reading '%s' with O_DIRECT (%s)\n", f->name, strerror(errno));
+		direct_close();
+	}
+
+	return pread(f->fd, buf, len, offset);
+}
+
+/* Shorten a read of len bytes of f at *pos to end at a DIRECT_ALIGN boundary,
+ * so the reads following it can go around the page cache */
+static inline size_t direct_len(const struct file_struct *f, const off_t *pos, size_t len)
+{
+	size_t head;
+
+	if (direct.f != f || !pos || (head = *pos % DIRECT_ALIGN) == 0)
+		return len;
+	return len < DIRECT_ALIGN - head ? len : DIRECT_ALIGN - head;
+}
+
+/* With --nocache, tell the kernel how f is going to be read, unless it is read
+ * with O_DIRECT anyway */
+static inline void advise(const struct file_struct *f, off_t offset, off_t len, int advice)
+{
+	if (nocache && direct.f != f)
+		posix_fadvise(f->fd, offset, len, advice);
+}
+
+/* With --nocache, drop [*from, to) of f from the page cache and move *from up
+ * to to. Unless done, only up to the last multiple of DROP_BEHIND. */
+static void drop_behind(const struct file_struct *f, off_t *from, off_t to, int done)
+{
+	/* Truncated or reopened since */
+	if (*from > to)
+		*from = to;
+	/* Pages still referenced, like the ones just spliced into a pipe, and
+	 * large folios reaching beyond the end of the range are kept. So stay
+	 * DROP_BEHIND bytes behind, at a multiple of it, until done. */
+	if (!done)
+		to -= to % DROP_BEHIND + DROP_BEHIND;
+	if (!nocache || to <= *from)
+		return;
+
+	posix_fadvise(f->fd, *from, to - *from, POSIX_FADV_DONTNEED);
+	*from = to;
+}
+
+/*
+ * Holes
+ *
+ * Writers seeking ahead or writing their logs ring buffer style leave holes in
+ * them, which read as NULs. The scanners looking for lines in files found to
+ * have holes skip them using SEEK_DATA and SEEK_HOLE rather than reading them,
+ * there are no newlines in them. The output is left alone, holes are copied as
+ * the NULs they read as.
+ */
+
+/* Start of the data of f at or after offset, -1 if there is only a hole up to
+ * its end. Everything is data if the file system can't tell. */
+static off_t next_data(const struct file_struct *f, off_t offset)
+{
+	off_t data = lseek(f->fd, offset, SEEK_DATA);
+
+	if (data < 0 && errno != ENXIO)
+		return offset;
+	return data;
+}
+
+/* Start of the hole of f at or after offset, which is its end if there is no
+ * other one */
+static off_t next_hole(const struct file_struct *f, off_t offset)
+{
+	off_t hole = lseek(f->fd, offset, SEEK_HOLE);
+
+	return hole < 0 ? OFF_T_MAX : hole;
+}
+
+/* Whether f has holes. Only files taking up less space than their size are
+ * asked, so files without holes cost no extra syscalls. */
+static int is_sparse(const struct file_struct *f, const struct stat *finfo)
+{
+	if ((off_t) finfo->st_blocks * 512 >= finfo->st_size)
+		return 0;
+
+	stats.syscalls++;
+	return next_hole(f, 0) < finfo->st_size;
+}
+
+/* Skip back over the hole of f ending at offset, if any. Returns where the data
+ * before it ends, 0 if there is none. step is how far to look back first. */
+static off_t prev_data_end(const struct file_struct *f, off_t offset, off_t step)
+{
+	off_t start, data, hole;
+
+	if (offset == 0 || next_data(f, offset - 1) == offset - 1)
+		return offset;
+
+	/* There is no SEEK_DATA backwards, look further and further back */
+	do {
+		start = offset > step ? offset - step : 0;
+		data = next_data(f, start);
+		step *= 2;
+	} while ((data < 0 || data >= offset) && start > 0);
+
+	if (data < 0 || data >= offset)
+		return 0;
+
+	/* The data ends where the last hole before offset starts */
+	while ((hole = next_hole(f, data)) < offset) {
+		data = next_data(f, hole);
+		if (data < 0 || data >= offset)
+			return hole;
+	}
+
+	return offset;
+}
+
+/* Move a forward scan of f at *offset past the hole there, if any. *hole is
+ * where the next hole starts, 0 to find out or OFF_T_MAX for files without
+ * holes. */
+static void skip_hole(const struct file_struct *f, off_t *offset, off_t *hole)
+{
+	off_t data;
+
+	if (*offset < *hole)
+		return;
+
+	data = next_data(f, *offset);
+	*offset = data < 0 ? f->size : data;
+	*hole = next_hole(f, *offset);
+}
+
+/* Read from f at *pos and advance it, or from the current position if pos is
+ * NULL */
+static inline ssize_t read_at(const struct file_struct *f, char *buf, size_t len, off_t *pos)
+{
+	ssize_t rc;
+
+	stats.syscalls++;
+	if (!pos)
+		return read(f->fd, buf, len);
+
+	rc = file_read(f, buf, len, *pos);
+	if (rc > 0)
+		*pos += rc;
+	return rc;
+}
+
+/* Reading less than asked for from a regular file means we are at its end,
+ * there is no need for another read to find out */
+static inline int read_eof(const struct file_struct *f, ssize_t rc, size_t len)
+{
+	return S_ISREG(f->mode) && (size_t) rc < len;
+}
+
+/* Copy up to max bytes of f to stdout like copy_to_stdout(), but only the
+ * lines passing the filters */
+static off_t filter_copy(struct file_struct *f, off_t max)
+{
+	char *buf = io_buffer(f->blksize);
+	off_t copied = 0, pos, *ppos = file_pos(f, &pos);
+	size_t len;
+	ssize_t rc;
+
+	while (copied != max) {
+		len = direct_len(f, ppos, copy_len(max, copied, io_buf.size));
+		rc = read_at(f, buf, len, ppos);
+		if (rc == 0)
+			break;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (filter_lines(&f->carry, buf, rc, line_atomic ? queue_sink : stdout_sink, f) < 0)
+			break;
+		copied += rc;
+		if (ppos)
+			drop_behind(f, &f->dropped, pos, 0);
+		if (read_eof(f, rc, len))
+			break;
+		/* Leave the rest in the file until stdout takes more */
+		if (out_stalled && max != COPY_ALL)
+			break;
+	}
+
+	return copied;
+}
+
+/*
+ * Copy up to max bytes (or everything for COPY_ALL) of f starting at f->size
+ * (or from where a pipe is at) to stdout as they are, stopping at EOF. This is
+ * done in the kernel using splice(), sendfile() or copy_file_range() if the
+ * type of stdout permits it, otherwise by read()/write() through a buffer.
+ *
+ * Returns the number of bytes copied.
+ */
+static off_t copy_raw(struct file_struct *f, off_t max)
+{
+	char method = copy_method;
+	off_t copied = 0, pos, *ppos = file_pos(f, &pos);
+	size_t len;
+	ssize_t rc;
+	char *buf;
+
+	/* Queued output goes first, O_DIRECT reads need to go through buf */
+	if (out.len > 0 || out_stalled || direct.f == f)
+		method = COPY_RW;
+
+	while (method != COPY_RW && copied != max) {
+		len = copy_len(max, copied, COPY_CHUNK);
+
+		/* These advance pos themselves */
+		if (method == COPY_SPLICE)
+			rc = splice(f->fd, ppos, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE);
+		else if (method == COPY_FILE_RANGE)
+			rc = copy_file_range(f->fd, ppos, STDOUT_FILENO, NULL, len, 0);
+		else
+			rc = sendfile(STDOUT_FILENO, f->fd, ppos, len);
+
+		stats.syscalls++;
+		if (rc > 0) {
+			stats.bytes_written += rc;
+			copied += rc;
+			if (ppos)
+				drop_behind(f, &f->dropped, pos, 0);
+			continue;
+		} else if (rc == 0)
+			return copied;
+
+		switch (errno) {
+		case EINTR:
+			continue;
+		case EAGAIN:
+			/* stdout is full */
+			if (out_blocking) {
+				if (wait_writable(STDOUT_FILENO) == 0)
+					continue;
+				return copied;
+			}
+			out_stall(1);
+			if (max != COPY_ALL)
+				return copied;
+			/* Draining the file, queue the rest */
+			method = COPY_RW;
+			break;
+		case ENOSYS:
+			/* Not available at all, don't bother again */
+			copy_method = COPY_RW;
+			/* fall through */
+		case EINVAL:
+		case EXDEV:
+		case EOPNOTSUPP:
+			/* Not supported for this pair of files, e.g. copying
+			 * between file systems or from /proc */
+			method = (method == COPY_FILE_RANGE) ? COPY_SENDFILE : COPY_RW;
+			dprintf("D: Falling back to copy method %d for '%s'\n", method, f->name);
+			break;
+		default:
+			/* e.g. when writing to a pipe which gets closed */
+			return copied;
+		}
+	}
+
+	if (method != COPY_RW)
+		return copied;
+
+	buf = io_buffer(f->blksize);
+
+	while (copied != max) {
+		len = direct_len(f, ppos, copy_len(max, copied, io_buf.size));
+		rc = read_at(f, buf, len, ppos);
+		if (rc == 0)
+			break;
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (out_write(buf, rc) < 0)
+			break;
+		copied += rc;
+		if (ppos)
+			drop_behind(f, &f->dropped, pos, 0);
+		if (read_eof(f, rc, len))
+			break;
+		if (out_stalled && max != COPY_ALL)
+			break;
+	}
+
+	return copied;
+}
+
+/* Where the last complete line of f in [start, end) ends, 0 if there is none
+ * close to end */
+static off_t lines_end(struct file_struct *f, off_t start, off_t end)
+{
+	char *buf = io_buffer(f->blksize);
+	off_t from = end - start > (off_t) io_buf.size ? end - (off_t) io_buf.size : start;
+	ssize_t rc;
+	char *nl;
+
+	if (end <= start)
+		return 0;
+
+	stats.syscalls++;
+	rc = pread(f->fd, buf, end - from, from);
+	if (rc <= 0 || !(nl = memrchr(buf, '\n', rc)))
+		return 0;
+
+	return from + (nl + 1 - buf);
+}
+
+/*
+ * Copy up to max bytes of f to stdout like copy_raw() while following several
+ * files, without mixing up their lines. Small appends are read and collected
+ * in out as complete lines, to be written in batches with those of the other
+ * files. Appends too big to be worth collecting are still copied in the kernel
+ * after writing out the queue, up to their last newline. Only the incomplete
+ * line at their end is held back then.
+ */
+static off_t line_copy(struct file_struct *f, off_t max)
+{
+	off_t start = f->size, end, copied;
+	size_t len = copy_len(max, 0, OUTPUT_FLUSH_SIZE);
+
+	copied = filter_copy(f, len);
+	if ((size_t) copied < len || copied == max)
+		return copied;
+
+	/* More to come, move on past what was read */
+	f->size += copied;
+	if (IS_PIPELIKE(f->mode) || direct.f == f || copy_method == COPY_RW || out_stalled)
+		goto queue;
+
+	stats.syscalls++;
+	end = lseek(f->fd, 0, SEEK_END);
+	if (max != COPY_ALL && end > start + max)
+		end = start + max;
+	end = lines_end(f, f->size, end);
+	if (end == 0)
+		goto queue;
+
+	/* Complete the line already started, the rest follows right after */
+	if (f->carry.len > 0) {
+		struct iovec iov = { f->carry.buf, f->carry.len };
+
+		queue_sink(f, &iov, 1);
+		f->carry.len = 0;
+	}
+	out_flush();
+	if (out.len > 0)
+		goto queue;
+
+	/* Stalling stdout might cut the last line short, its rest is then
+	 * queued before anything else right below */
+	f->size += copy_raw(f, end - f->size);
+queue:
+	f->size += filter_copy(f, max == COPY_ALL ? COPY_ALL : start + max - f->size);
+	copied = f->size - start;
+	f->size = start;
+	return copied;
+}
+
+/*
+ * Copy up to max bytes (or everything for COPY_ALL) of f starting at f->size
+ * (or from where a pipe is at) to stdout, stopping at EOF. Only the lines
+ * passing the filters are output, and only whole lines while following several
+ * files.
+ *
+ * Returns the number of bytes copied.
+ */
+static off_t copy_to_stdout(struct file_struct *f, off_t max)
+{
+	if (filtering)
+		return filter_copy(f, max);
+	if (line_atomic)
+		return line_copy(f, max);
+	return copy_raw(f, max);
+}
+
+/*
+ * Copy up to max bytes of data of f to stdout like copy_to_stdout() and move
+ * f->size along.
+ *
+ * Returns the number of bytes copied.
+ */
+static off_t copy_data(struct file_struct *f, off_t max)
+{
+	off_t copied = copy_to_stdout(f, max);
+
+	f->size += copied;
+	return copied;
+}
+
+/* Start of the last n_lines lines of f ending at end */
+static off_t lines_before(struct file_struct *f, off_t end, unsigned long n_lines)
+{
+	off_t offset = end;
+	size_t window = scan_window(f);
+	char *buf = io_buffer(window);
+
+	/* We also count the last \n */
+	++n_lines;
+
+	while (offset > 0) {
+		ssize_t rc, i;
+		off_t block_start = 0;
+
+		/* No newlines in holes */
+		if (f->sparse) {
+			offset = prev_data_end(f, offset, window);
+			if (offset == 0)
+				break;
+		}
+
+		/* Read whole windows aligned to the file's block size, only the
+		 * first read (at the end of the file) might be shorter */
+		if (offset > (off_t) window) {
+			/* Round up, the read needs to fit into the window */
+			block_start = offset - window;
+			if (block_start % f->blksize)
+				block_start += f->blksize - block_start % f->blksize;
+		}
+
+		/* Read ahead the window before while scanning this one, the
+		 * kernel only reads ahead forwards itself */
+		if (offset != end && block_start > 0)
+			advise(f, block_start > (off_t) window ? block_start - window : 0,
+			       window, POSIX_FADV_WILLNEED);
+
+		rc = file_read(f, buf, offset - block_start, block_start);
+		if (unlikely(rc < 0)) {
+			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		}
+
+		/* Short read if the file got truncated under us, scan what we got */
+		i = rscan_nl(buf, rc, &n_lines);
+		if (i >= 0)
+			return block_start + i + 1; /* We don't want the first \n */
+
+		offset = block_start;
+	}
+
+	return offset;
+}
+
+static off_t lines_to_offset_from_end(struct file_struct *f, unsigned long n_lines)
+{
+	return lines_before(f, f->size, n_lines);
+}
+
+/*
+ * Like lines_to_offset_from_end(), but only counting lines passing the filters.
+ * Lines are only looked at as a whole, so windows ending in the middle of a
+ * line are moved back to end at its end, and grown for lines longer than them.
+ */
+static off_t matching_lines_to_offset_from_end(struct file_struct *f, unsigned long n_lines)
+{
+	off_t end = f->size;
+	size_t window = scan_window(f);
+	char *buf = io_buffer(window);
+
+	if (n_lines == 0)
+		return end;
+
+	while (end > 0) {
+		off_t block_start = 0, line_start = 0;
+		ssize_t rc, pos;
+		int matches, spans_hole = 0;
+
+		if (f->sparse) {
+			end = prev_data_end(f, end, window);
+			if (end == 0)
+				break;
+		}
+
+		if (end > (off_t) window) {
+			block_start = end - window;
+			if (block_start % f->blksize)
+				block_start += f->blksize - block_start % f->blksize;
+		}
+
+		if (end != f->size && block_start > 0)
+			advise(f, block_start > (off_t) window ? block_start - window : 0,
+			       window, POSIX_FADV_WILLNEED);
+
+		rc = file_read(f, buf, end - block_start, block_start);
+		if (unlikely(rc < 0)) {
+			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		}
+
+		/* Look at the lines ending at pos, back to front */
+		for (pos = rc; pos > 0; ) {
+			/* Skip the line's own newline */
+			const char *nl = memrchr(buf, '\n', pos - 1);
+			ssize_t start = nl ? nl - buf + 1 : 0;
+
+			/* Line starts before the window? Unless it reaches back
+			 * over a hole, then it is judged by the data after that
+			 * if it is too long to be read as a whole, see
+			 * --max-backlog */
+			if (!nl && block_start > 0) {
+				off_t data = f->sparse ? next_data(f, block_start) : block_start;
+
+				if (data <= block_start || data >= block_start + pos)
+					break;
+				start = data - block_start;
+				spans_hole = 1;
+			}
+
+			matches = line_matches(buf + start, pos - start - (buf[pos - 1] == '\n'));
+			if (spans_hole) {
+				line_start = lines_before(f, block_start, 0);
+				if (line_start < 0)
+					return -1;
+				if (block_start + pos - line_start <= max_backlog) {
+					/* Read it as a whole with the next window */
+					if ((off_t) window < block_start + pos - line_start + f->blksize)
+						window = block_start + pos - line_start + f->blksize;
+					buf = io_buffer(window);
+					spans_hole = 0;
+					break;
+				}
+				if (matches && --n_lines == 0)
+					return line_start;
+				break;
+			}
+			if (matches && --n_lines == 0)
+				return block_start + start;
+			pos = start;
+		}
+
+		if (spans_hole) {
+			end = line_start;
+			continue;
+		}
+		if (block_start + pos == end) {
+			/* Not even one line in the window */
+			window *= 2;
+			buf = io_buffer(window);
+		}
+		end = block_start + pos;
+	}
+
+	return 0;
+}
+
+/*
+ * Skip n_lines lines starting at offset. Returns the offset of the line
+ * following them, the file size if there are not that many lines or -1 on
+ * errors.
+ */
+static off_t skip_lines(struct file_struct *f, off_t offset, unsigned long n_lines)
+{
+	size_t window = scan_window(f);
+	char *buf = io_buffer(window);
+	off_t dropped = offset, hole = f->sparse ? 0 : OFF_T_MAX;
+
+	while (offset < f->size && n_lines > 0) {
+		ssize_t i, rc;
+
+		skip_hole(f, &offset, &hole);
+		if (offset >= f->size)
+			break;
+
+		/* Stay aligned for --direct */
+		rc = file_read(f, buf, window - offset % DIRECT_ALIGN, offset);
+
+		if (unlikely(rc < 0)) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		} else if (rc == 0)
+			break;
+
+		i = fscan_nl(buf, rc, &n_lines);
+		if (i >= 0) {
+			drop_behind(f, &dropped, offset + i + 1, 1);
+			return offset + i + 1;
+		}
+
+		offset += rc;
+		drop_behind(f, &dropped, offset, 0);
+	}
+
+	if (offset > f->size)
+		offset = f->size;
+	drop_behind(f, &dropped, offset, 1);
+
+	return offset;
+}
+
+/*
+ * Parallel newline counting
+ *
+ * With --parallel, large files are split into chunks of PARALLEL_CHUNK bytes,
+ * which are counted by n_threads threads in rounds. The chunk containing the
+ * line looked for is found by summing up the counts in order and only that
+ * chunk is then scanned for the line itself.
+ */
+static void *count_chunks(void *arg)
+{
+	struct count_job *job = arg;
+	char *buf = emalloc_aligned(DIRECT_ALIGN, SCAN_WINDOW);
+	size_t c;
+
+	while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n_chunks) {
+		off_t offset = job->start + (off_t) c * PARALLEL_CHUNK;
+		off_t end = offset + PARALLEL_CHUNK, dropped = offset;
+		off_t hole = job->f->sparse ? 0 : OFF_T_MAX;
+		unsigned long n = 0;
+
+		if (end > job->f->size)
+			end = job->f->size;
+		advise(job->f, offset, end - offset, POSIX_FADV_WILLNEED);
+
+		while (offset < end) {
+			size_t len;
+			ssize_t rc;
+
+			skip_hole(job->f, &offset, &hole);
+			if (offset >= end)
+				break;
+
+			len = SCAN_WINDOW - offset % DIRECT_ALIGN;
+			if ((off_t) len > end - offset)
+				len = end - offset;
+			rc = file_read(job->f, buf, len, offset);
+
+			if (unlikely(rc <= 0)) {
+				if (rc < 0 && errno == EINTR)
+					continue;
+				/* Shorter than expected, the sequential scan
+				 * will sort it out */
+				if (rc < 0)
+					job->error = errno;
+				break;
+			}
+
+			n += count_nl(buf, rc);
+			offset += rc;
+		}
+
+		drop_behind(job->f, &dropped, offset < end ? offset : end, 1);
+		job->counts[c] = n;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Find the chunk containing the line following n_lines newlines starting at
+ * offset. Returns the offset of the chunk and adjusts n_lines to the newlines
+ * still to skip from there. */
+static off_t skip_chunks(struct file_struct *f, off_t offset, unsigned long *n_lines)
+{
+	size_t max_chunks = n_threads * PARALLEL_ROUND;
+	pthread_t *threads = emalloc(n_threads * sizeof(pthread_t));
+	struct count_job job;
+	long i, n_started;
+
+	job.f = f;
+	job.counts = emalloc(max_chunks * sizeof(unsigned long));
+
+	while (f->size - offset >= PARALLEL_THRESHOLD) {
+		size_t c;
+
+		job.start = offset;
+		job.n_chunks = (f->size - offset + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+		if (job.n_chunks > max_chunks)
+			job.n_chunks = max_chunks;
+		job.next = 0;
+		job.error = 0;
+		memset(job.counts, 0, job.n_chunks * sizeof(unsigned long));
+
+		/* We're counting, too */
+		for (n_started = 0; n_started < n_threads - 1; n_started++)
+			if (pthread_create(&threads[n_started], NULL, count_chunks, &job) != 0)
+				break;
+		count_chunks(&job);
+		for (i = 0; i < n_started; i++)
+			pthread_join(threads[i], NULL);
+
+		if (job.error) {
+			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(job.error));
+			break;
+		}
+
+		for (c = 0; c < job.n_chunks; c++) {
+			if (job.counts[c] >= *n_lines) {
+				offset = job.start + (off_t) c * PARALLEL_CHUNK;
+				goto out;
+			}
+			*n_lines -= job.counts[c];
+		}
+
+		offset = job.start + (off_t) job.n_chunks * PARALLEL_CHUNK;
+		if (offset > f->size)
+			offset = f->size;
+	}
+out:
+	free(job.counts);
+	free(threads);
+
+	return offset;
+}
+
+/*
+ * Sparse line index
+ *
+ * With --line-index, the offset of every LINE_INDEX_STRIDE'th line of a file is
+ * kept in an index file next to it (or in the directory given), so 'inotail -n
+ * +N' only needs to scan from the closest indexed line onwards. An index is
+ * valid for the file with its device and inode. If the file grew since it was
+ * indexed, only the new data is indexed, if it got smaller or was modified
+ * without growing, it is indexed from scratch.
+ */
+static char *line_index_path(const struct file_struct *f, const struct stat *finfo)
+{
+	const char *base = strrchr(f->name, '/');
+	size_t len;
+	char *path;
+
+	if (line_index_dir) {
+		len = strlen(line_index_dir) + 2 * 16 + sizeof("/-" LINE_INDEX_SUFFIX);
+		path = emalloc(len);
+		snprintf(path, len, "%s/%llx-%llx" LINE_INDEX_SUFFIX, line_index_dir,
+				(unsigned long long) finfo->st_dev, (unsigned long long) finfo->st_ino);
+		return path;
+	}
+
+	/* Hidden file in the same directory */
+	base = base ? base + 1 : f->name;
+	len = strlen(f->name) + sizeof("." LINE_INDEX_SUFFIX);
+	path = emalloc(len);
+	snprintf(path, len, "%.*s.%s" LINE_INDEX_SUFFIX, (int) (base - f->name), f->name, base);
+
+	return path;
+}
+
+/* Load the index at path if it is valid for f. Returns the offsets or NULL if
+ * the file has to be indexed from scratch. */
+static uint64_t *line_index_load(struct file_struct *f, const struct stat *finfo,
+				 const char *path, struct line_index *idx)
+{
+	uint64_t *offsets = NULL;
+	struct stat iinfo;
+	size_t len;
+	int fd;
+	char c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (read(fd, idx, sizeof(*idx)) != sizeof(*idx) || fstat(fd, &iinfo) < 0)
+		goto invalid;
+
+	if (memcmp(idx->magic, LINE_INDEX_MAGIC, sizeof(idx->magic)) != 0 ||
+	    idx->stride != LINE_INDEX_STRIDE ||
+	    idx->dev != (uint64_t) finfo->st_dev || idx->ino != (uint64_t) finfo->st_ino ||
+	    idx->size > (uint64_t) f->size ||
+	    (uint64_t) iinfo.st_size != sizeof(*idx) + idx->n_offsets * sizeof(uint64_t))
+		goto invalid;
+
+	/* Same size, but modified */
+	if (idx->size == (uint64_t) f->size &&
+	    (idx->mtime_sec != finfo->st_mtim.tv_sec || idx->mtime_nsec != finfo->st_mtim.tv_nsec))
+		goto invalid;
+
+	len = idx->n_offsets * sizeof(uint64_t);
+	offsets = emalloc(len ? len : sizeof(uint64_t));
+	if (read(fd, offsets, len) != (ssize_t) len)
+		goto invalid;
+
+	/* Cheap check whether the file got rewritten: the last offset still
+	 * needs to be at the beginning of a line */
+	if (idx->n_offsets > 0 &&
+	    (pread(f->fd, &c, 1, offsets[idx->n_offsets - 1] - 1) != 1 || c != '\n'))
+		goto invalid;
+
+	close(fd);
+	return offsets;
+
+invalid:
+	dprintf("D: Line index '%s' invalid, rebuilding\n", path);
+	free(offsets);
+	close(fd);
+	return NULL;
+}
+
+/* Index the data appended to f since it was last indexed */
+static int line_index_extend(struct file_struct *f, struct line_index *idx,
+			     uint64_t **offsets, size_t *max_offsets)
+{
+	size_t window = scan_window(f);
+	char *buf = io_buffer(window);
+	off_t offset = idx->size, dropped = offset, hole = f->sparse ? 0 : OFF_T_MAX;
+	unsigned long n = idx->stride - idx->n_lines % idx->stride;
+
+	while (offset < f->size) {
+		ssize_t i = 0, rc;
+
+		skip_hole(f, &offset, &hole);
+		if (offset >= f->size)
+			break;
+
+		rc = file_read(f, buf, window - offset % DIRECT_ALIGN, offset);
+
+		if (unlikely(rc < 0)) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		} else if (rc == 0)
+			break;
+
+		while (i < rc) {
+			unsigned long left = n;
+			ssize_t j = fscan_nl(buf + i, rc - i, &n);
+
+			if (j < 0) {
+				idx->n_lines += left - n;
+				break;
+			}
+
+			if (idx->n_offsets == *max_offsets) {
+				*max_offsets = *max_offsets ? 2 * *max_offsets : 64;
+				*offsets = erealloc(*offsets, *max_offsets * sizeof(uint64_t));
+			}
+			(*offsets)[idx->n_offsets++] = offset + i + j + 1;
+			idx->n_lines += left;
+			i += j + 1;
+			n = idx->stride;
+		}
+
+		offset += rc;
+		drop_behind(f, &dropped, offset, 0);
+	}
+
+	drop_behind(f, &dropped, offset, 1);
+	idx->size = offset;
+
+	return 0;
+}
+
+/* Atomically replace the index at path of a file with the given mode */
+static void line_index_save(const char *path, const struct line_index *idx,
+			    const uint64_t *offsets, mode_t mode)
+{
+	size_t len = strlen(path) + sizeof(".XXXXXX");
+	char *tmp = emalloc(len);
+	mode_t mask;
+	int fd;
+
+	snprintf(tmp, len, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto err;
+
+	/* mkstemp() creates the file readable only by us, but whoever may read
+	 * the file may use its index as well */
+	mask = umask(0);
+	umask(mask);
+	fchmod(fd, mode & 0666 & ~mask);
+
+	if (write_all(fd, (const char *) idx, sizeof(*idx)) != sizeof(*idx) ||
+	    write_all(fd, (const char *) offsets, idx->n_offsets * sizeof(uint64_t)) !=
+			(ssize_t) (idx->n_offsets * sizeof(uint64_t)) ||
+	    close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		goto err;
+	}
+
+	free(tmp);
+	return;
+err:
+	fprintf(stderr, "Warning: Could not write line index '%s' (%s)\n", path, strerror(errno));
+	free(tmp);
+}
+
+/*
+ * Look up where to start scanning f for the line following n_lines newlines
+ * using the line index, creating or updating the index as necessary. Returns
+ * the offset to start at and adjusts n_lines to the number of newlines still
+ * to skip from there.
+ */
+static off_t line_index_seek(struct file_struct *f, unsigned long *n_lines)
+{
+	struct line_index idx;
+	struct stat finfo;
+	uint64_t *offsets;
+	size_t max_offsets;
+	off_t offset = 0;
+	char *path;
+	unsigned long n;
+
+	if (fstat(f->fd, &finfo) < 0)
+		return 0;
+
+	path = line_index_path(f, &finfo);
+	offsets = line_index_load(f, &finfo, path, &idx);
+	if (offsets) {
+		max_offsets = idx.n_offsets;
+	} else {
+		memset(&idx, 0, sizeof(idx));
+		memcpy(idx.magic, LINE_INDEX_MAGIC, sizeof(idx.magic));
+		idx.stride = LINE_INDEX_STRIDE;
+		idx.dev = finfo.st_dev;
+		idx.ino = finfo.st_ino;
+		max_offsets = 0;
+	}
+
+	if (idx.size < (uint64_t) f->size || !offsets) {
+		if (line_index_extend(f, &idx, &offsets, &max_offsets) == 0) {
+			idx.mtime_sec = finfo.st_mtim.tv_sec;
+			idx.mtime_nsec = finfo.st_mtim.tv_nsec;
+			line_index_save(path, &idx, offsets, finfo.st_mode);
+		}
+	}
+
+	/* Start at the closest indexed line */
+	n = *n_lines / idx.stride;
+	if (n > idx.n_offsets)
+		n = idx.n_offsets;
+	if (n > 0) {
+		offset = offsets[n - 1];
+		*n_lines -= n * idx.stride;
+	}
+
+	free(offsets);
+	free(path);
+
+	return offset;
+}
+
+static off_t lines_to_offset_from_begin(struct file_struct *f, unsigned long n_lines)
+{
+	off_t offset = 0;
+
+	/* tail everything for 'inotail -n +0' */
+	if (n_lines == 0)
+		return 0;
+
+	n_lines--;
+	if (n_lines == 0)
+		return 0;
+
+	if (line_index && f->size >= LINE_INDEX_THRESHOLD)
+		offset = line_index_seek(f, &n_lines);
+	if (n_threads > 0)
+		offset = skip_chunks(f, offset, &n_lines);
+
+	return skip_lines(f, offset, n_lines);
+}
+
+static off_t lines_to_offset(struct file_struct *f, unsigned long n_lines)
+{
+	if (from_begin)
+		return lines_to_offset_from_begin(f, n_lines);
+	else if (filtering)
+		return matching_lines_to_offset_from_end(f, n_lines);
+	else
+		return lines_to_offset_from_end(f, n_lines);
+}
+
+static off_t bytes_to_offset(struct file_struct *f, unsigned long n_bytes)
+{
+	off_t offset = 0;
+
+	/* tail everything for 'inotail -c +0' */
+	if (from_begin) {
+		if (n_bytes > 0)
+			offset = (off_t) n_bytes - 1;
+	} else if ((off_t) n_bytes < f->size)
+		offset = f->size - (off_t) n_bytes;
+
+	/* Otherwise offset stays 0 (begin of file) */
+
+	return offset;
+}
+
+/*
+ * Timestamp based seeking
+ *
+ * With --since/--until, the start and end of the output are looked up by
+ * binary search over the file, assuming that the timestamps at the beginning
+ * of its lines are sorted. Lines without a timestamp (e.g. continuation lines
+ * of a stack trace) belong to the preceding line.
+ */
+
+/* Parse a time according to format. Fields not in format default to the
+ * beginning of today. Returns a pointer to the first character not parsed or
+ * NULL if s doesn't match. */
+static const char *parse_time(const char *s, const char *format, time_t *t)
+{
+	static struct tm today;
+	static int have_today = 0;
+	struct tm tm;
+	const char *end;
+
+	if (!have_today) {
+		time_t now = time(NULL);
+
+		localtime_r(&now, &today);
+		today.tm_hour = today.tm_min = today.tm_sec = 0;
+		have_today = 1;
+	}
+
+	tm = today;
+	end = strptime(s, format, &tm);
+	if (!end)
+		return NULL;
+
+	tm.tm_isdst = -1;
+	*t = mktime(&tm);
+
+	return end;
+}
+
+/* Parse the argument to --since/--until: a time in the timestamp format, one of
+ * some common formats or seconds since the Epoch prefixed by '@' */
+static int parse_time_arg(const char *s, time_t *t)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S", "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M",
+		"%Y-%m-%d", "%H:%M:%S", "%H:%M", NULL
+	};
+	const char *end;
+	int i;
+
+	if (*s == '@') {
+		char *e;
+
+		*t = strtol(s + 1, &e, 10);
+		return (e != s + 1 && *e == '\0') ? 0 : -1;
+	}
+
+	end = parse_time(s, time_format, t);
+	if (end && *end == '\0')
+		return 0;
+
+	for (i = 0; formats[i]; i++) {
+		end = parse_time(s, formats[i], t);
+		if (end && *end == '\0')
+			return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Look for the first line starting in [*offset, limit) with a timestamp,
+ * reading one I/O buffer of f at most. Returns 1 with the line's offset in
+ * *offset and its timestamp in *t, 0 with *offset moved on to where to look
+ * further if there is no such line in what was read, or -1 on errors.
+ */
+static int next_timed_line(struct file_struct *f, off_t *offset, off_t limit, time_t *t)
+{
+	char *buf = io_buffer(f->blksize);
+	char line[TIME_PREFIX_MAX + 1];
+	/* A line starts at offset if the previous one ended right before */
+	off_t from = *offset > 0 ? *offset - 1 : 0;
+	size_t len = copy_len(limit + TIME_PREFIX_MAX, from, io_buf.size);
+	char *p, *end, *nl;
+	ssize_t rc;
+
+	if (*offset >= limit)
+		return 0;
+
+	do {
+		rc = pread(f->fd, buf, len, from);
+	} while (rc < 0 && errno == EINTR);
+	if (unlikely(rc < 0)) {
+		fprintf(stderr, "Error: Could not read from file '%s' (%s)\n", f->name, strerror(errno));
+		return -1;
+	}
+
+	end = buf + rc;
+	p = (*offset == 0) ? buf : memchr(buf, '\n', rc);
+	if (p && *offset > 0)
+		p++;
+
+	while (p && p < end && from + (p - buf) < limit) {
+		size_t n = end - p < TIME_PREFIX_MAX ? end - p : TIME_PREFIX_MAX;
+
+		nl = memchr(p, '\n', n);
+		/* Cut short by the end of the buffer, look at it next time */
+		if (!nl && n < TIME_PREFIX_MAX && (size_t) rc == len) {
+			*offset = from + (p - buf);
+			return 0;
+		}
+
+		/* Only look at this line */
+		memcpy(line, p, n);
+		line[nl ? nl - p : (ssize_t) n] = '\0';
+		if (parse_time(line, time_format, t)) {
+			*offset = from + (p - buf);
+			return 1;
+		}
+
+		p = memchr(p, '\n', end - p);
+		if (p)
+			p++;
+	}
+
+	*offset = (size_t) rc < len ? limit : from + rc;
+	if (*offset > limit)
+		*offset = limit;
+	return 0;
+}
+
+/*
+ * Offset of the first line with a timestamp of at least t, the file size if
+ * there is none or -1 on errors. The search range is halved by probing one I/O
+ * buffer in the middle of it. A probe without any timestamps is taken for
+ * there being none up to the end of the range, so only lines without a
+ * timestamp running for longer than the buffer can throw the search off.
+ */
+static off_t time_to_offset(struct file_struct *f, time_t t)
+{
+	static const struct file_struct *warned = NULL;
+	/* The line we look for starts within [lo, hi), otherwise it is the one
+	 * at end */
+	off_t lo = 0, hi = f->size, end = f->size, q;
+	char timed = 0;
+	time_t lt;
+	int found;
+
+	while (hi - lo > TIME_SEEK_LINEAR) {
+		q = lo + (hi - lo) / 2;
+		found = next_timed_line(f, &q, hi, &lt);
+		if (found < 0)
+			return -1;
+
+		if (!found)
+			hi = lo + (hi - lo) / 2;
+		else if (lt < t)
+			lo = q + 1;
+		else
+			hi = end = q;
+		timed |= found;
+	}
+
+	while (lo < hi) {
+		found = next_timed_line(f, &lo, hi, &lt);
+		if (found < 0)
+			return -1;
+		if (found && lt >= t)
+			return lo;
+		if (found)
+			lo++;
+		timed |= found;
+	}
+
+	/* Once per file, the end is looked up with --until as well */
+	if (!timed && end == f->size && f->size > 0 && warned != f) {
+		warned = f;
+		fprintf(stderr, "Warning: No timestamps in the format of --time-format found in '%s'\n",
+				pretty_name(f->name));
+	}
+
+	return end;
+}
+
+/* Write buf to stdout, only the lines passing the filters if filtering */
+static void write_lines(struct file_struct *f, const char *buf, size_t len)
+{
+	if (filtering)
+		filter_lines(&f->carry, buf, len, stdout_sink, NULL);
+	else
+		write(STDOUT_FILENO, buf, len);
+}
+
+static int tail_pipe_from_begin(struct file_struct *f, unsigned long n_units, const char mode)
+{
+	int bytes_read = 0;
+	char buf[BUFSIZ];
+
+	if (n_units)
+		n_units--;
+
+	while (n_units > 0) {
+		if ((bytes_read = read(f->fd, buf, BUFSIZ)) <= 0) {
+			/* Interrupted by a signal, retry reading */
+			if (bytes_read < 0 && (errno == EINTR || errno == EAGAIN))
+				continue;
+			else
+				return bytes_read;
+		}
+
+		if (mode == M_LINES) {
+			int i;
+			ssize_t block_size = BUFSIZ;
+
+			if (bytes_read < BUFSIZ)
+				block_size = bytes_read;
+
+			for (i = 0; i < block_size; i++) {
+				if (buf[i] == '\n') {
+					if (--n_units == 0)
+						break;
+				}
+			}
+
+			/* Print remainder of the current block */
+			if (++i < block_size)
+				write_lines(f, &buf[i], bytes_read - i);
+		} else {
+			if ((unsigned long) bytes_read > n_units) {
+				write_lines(f, &buf[n_units], bytes_read - n_units);
+				bytes_read = n_units;
+			}
+
+			n_units -= bytes_read;
+		}
+	}
+
+	while ((bytes_read = read(f->fd, buf, BUFSIZ)) > 0)
+		write_lines(f, buf, (size_t) bytes_read);
+
+	if (!follow)
+		filter_flush(&f->carry, stdout_sink, NULL);
+
+	return 0;
+}
+
+static void ring_init(struct ring *r, size_t size)
+{
+	r->buf = emalloc(size);
+	r->size = size;
+	r->start = r->len = 0;
+	r->n_lines = 0;
+	/* Two adjacent segments always hold more than RING_SEG bytes */
+	r->max_segs = 2 * (size / RING_SEG) + 2;
+	r->segs = emalloc(r->max_segs * sizeof(struct ring_seg));
+	r->seg_first = r->n_segs = 0;
+}
+
+static void ring_free(struct ring *r)
+{
+	free(r->segs);
+	free(r->buf);
+}
+
+/* Index one past the newest byte, i.e. where the next read goes */
+static inline size_t ring_end(const struct ring *r)
+{
+	size_t end = r->start + r->len;
+
+	return end >= r->size ? end - r->size : end;
+}
+
+/* Double the size of the ring */
+static void ring_grow(struct ring *r)
+{
+	size_t i, wrapped = 0;
+	struct ring_seg *segs;
+
+	if (r->start + r->len > r->size)
+		wrapped = r->start + r->len - r->size;
+
+	r->buf = erealloc(r->buf, r->size * 2);
+	/* Move the wrapped around part behind the rest */
+	memcpy(r->buf + r->size, r->buf, wrapped);
+	r->size *= 2;
+
+	segs = emalloc((2 * r->max_segs) * sizeof(struct ring_seg));
+	for (i = 0; i < r->n_segs; i++)
+		segs[i] = r->segs[(r->seg_first + i) % r->max_segs];
+	free(r->segs);
+	r->segs = segs;
+	r->seg_first = 0;
+	r->max_segs *= 2;
+}
+
+/* Account for rc bytes holding n_lines newlines just read into the ring */
+static void ring_add(struct ring *r, size_t n_bytes, unsigned long n_lines)
+{
+	struct ring_seg *seg = NULL;
+
+	if (r->n_segs > 0)
+		seg = &r->segs[(r->seg_first + r->n_segs - 1) % r->max_segs];
+
+	if (!seg || seg->len + n_bytes > RING_SEG) {
+		seg = &r->segs[(r->seg_first + r->n_segs) % r->max_segs];
+		seg->len = 0;
+		seg->n_lines = 0;
+		r->n_segs++;
+	}
+
+	seg->len += n_bytes;
+	seg->n_lines += n_lines;
+	r->len += n_bytes;
+	r->n_lines += n_lines;
+}
+
+static void ring_drop(struct ring *r, size_t n_bytes)
+{
+	r->start += n_bytes;
+	if (r->start >= r->size)
+		r->start -= r->size;
+	r->len -= n_bytes;
+}
+
+/* Drop the oldest segments as long as the rest holds more than n_lines
+ * newlines, i.e. still contains the last n_lines lines including the start of
+ * the first one */
+static void ring_drop_lines(struct ring *r, unsigned long n_lines)
+{
+	while (r->n_segs > 0) {
+		struct ring_seg *seg = &r->segs[r->seg_first];
+
+		if (r->n_lines - seg->n_lines <= n_lines)
+			break;
+
+		ring_drop(r, seg->len);
+		r->n_lines -= seg->n_lines;
+		r->seg_first = (r->seg_first + 1) % r->max_segs;
+		r->n_segs--;
+	}
+}
+
+/* Number of bytes up to and including the n_lines'th newline in the ring.
+ * There must be at least that many newlines in the ring. */
+static size_t ring_lines_len(const struct ring *r, unsigned long n_lines)
+{
+	size_t first = r->size - r->start;	/* Bytes before the wrap around */
+	ssize_t i;
+
+	if (first > r->len)
+		first = r->len;
+
+	i = fscan_nl(r->buf + r->start, first, &n_lines);
+	if (i >= 0)
+		return i + 1;
+
+	/* Continue in the wrapped around part */
+	return first + fscan_nl(r->buf, r->len - first, &n_lines) + 1;
+}
+
+/*
+ * Make room for new data in the ring, dropping the oldest data not needed for
+ * the tail of n_units lines or bytes or growing the ring if there is none.
+ * Returns the index where the data goes and stores the number of bytes fitting
+ * there contiguously to *space.
+ */
+static size_t ring_reserve(struct ring *r, unsigned long n_units, char mode, size_t *space)
+{
+	size_t end;
+
+	if (r->len == r->size) {
+		/* Drop what we don't need anymore */
+		if (mode == M_LINES)
+			ring_drop_lines(r, n_units);
+		else if (r->len > n_units)
+			ring_drop(r, r->len - n_units);
+
+		if (r->len == r->size)
+			ring_grow(r);
+	}
+
+	end = ring_end(r);
+	if (r->len == 0)
+		r->start = end = 0;
+	/* Free space is contiguous up to the end of the buffer or up to
+	 * the oldest byte if the data wraps around already */
+	*space = (end >= r->start) ? r->size - end : r->start - end;
+	if (*space > RING_SEG)
+		*space = RING_SEG;
+
+	return end;
+}
+
+/* Account for n_bytes just stored at index end of the ring */
+static inline void ring_commit(struct ring *r, char mode, size_t end, size_t n_bytes)
+{
+	if (mode == M_LINES)
+		ring_add(r, n_bytes, count_nl(r->buf + end, n_bytes));
+	else
+		r->len += n_bytes;
+}
+
+/* Copy the runs of matching lines into the ring */
+static int ring_sink(void *arg, struct iovec *iov, int n_iov)
+{
+	struct ring_fill *rf = arg;
+	int i;
+
+	for (i = 0; i < n_iov; i++) {
+		const char *p = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
+
+		while (len > 0) {
+			size_t space, end = ring_reserve(rf->r, rf->n_units, rf->mode, &space);
+
+			if (space > len)
+				space = len;
+			memcpy(rf->r->buf + end, p, space);
+			ring_commit(rf->r, rf->mode, end, space);
+			p += space;
+			len -= space;
+		}
+	}
+
+	return 0;
+}
+
+/* Write the newest n_bytes of the ring to stdout */
+static int ring_write(const struct ring *r, size_t n_bytes)
+{
+	struct iovec iov[2];
+	size_t start = r->start + (r->len - n_bytes);
+	int n_iov = 1;
+
+	if (start >= r->size)
+		start -= r->size;
+
+	iov[0].iov_base = r->buf + start;
+	iov[0].iov_len = n_bytes;
+	if (start + n_bytes > r->size) {
+		iov[0].iov_len = r->size - start;
+		iov[1].iov_base = r->buf;
+		iov[1].iov_len = n_bytes - iov[0].iov_len;
+		n_iov = 2;
+	}
+
+	return writev_all(STDOUT_FILENO, iov, n_iov);
+}
+
+/*
+ * Tail a non-seekable file. Everything is read into a ring buffer which only
+ * grows if it cannot hold the requested number of lines or bytes. Once it is
+ * full, the oldest data not needed for the tail is dropped to make room. When
+ * tailing lines, the ring keeps the number of newlines per segment of up to
+ * RING_SEG bytes, so dropping data never needs to look at it again.
+ */
+static int tail_pipe(struct file_struct *f, unsigned long n_units, char mode)
+{
+	struct ring r;
+	ssize_t rc;
+	size_t n_bytes;
+
+	if (from_begin)
+		return tail_pipe_from_begin(f, n_units, mode);
+
+	if (n_units == 0)
+		return 0;	/* Nothing to tail */
+
+	ring_init(&r, RING_SIZE);
+
+	if (filtering) {
+		struct ring_fill rf = { &r, n_units, mode };
+		char *buf = io_buffer(RING_SEG);
+
+		/* Only matching lines go into the ring */
+		while ((rc = read(f->fd, buf, io_buf.size)) != 0) {
+			if (rc < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				break;
+			}
+			filter_lines(&f->carry, buf, rc, ring_sink, &rf);
+		}
+		filter_flush(&f->carry, ring_sink, &rf);
+	} else {
+		while (1) {
+			size_t space, end = ring_reserve(&r, n_units, mode, &space);
+
+			if ((rc = read(f->fd, r.buf + end, space)) <= 0) {
+				if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+					continue;
+				else
+					break;	/* No more data to read */
+			}
+
+			ring_commit(&r, mode, end, rc);
+		}
+	}
+
+	if (rc < 0) {
+		fprintf(stderr, "Error: Could not read from %s\n", pretty_name(f->name));
+		goto out;
+	}
+
+	n_bytes = r.len;
+	if (mode == M_LINES) {
+		unsigned long total_lines;
+
+		ring_drop_lines(&r, n_units);
+		n_bytes = r.len;
+		total_lines = r.n_lines;
+
+		/* Count incomplete lines */
+		if (r.len > 0 && r.buf[ring_end(&r) == 0 ? r.size - 1 : ring_end(&r) - 1] != '\n')
+			++total_lines;
+
+		/* Read too many lines, advance */
+		if (total_lines > n_units)
+			n_bytes -= ring_lines_len(&r, total_lines - n_units);
+	} else if (n_bytes > n_units)
+		n_bytes = n_units;
+
+	rc = 0;
+	if (n_bytes > 0 && ring_write(&r, n_bytes) < 0) {
+		/* e.g. when writing to a pipe which gets closed */
+		fprintf(stderr, "Error: Could not write to stdout (%s)\n", strerror(errno));
+		rc = -1;
+	}
+
+out:
+	ring_free(&r);
+	return rc;
+}
+
+static void sigbus_handler(int sig)
+{
+	if (sigbus_armed) {
+		sigbus_armed = 0;
+		siglongjmp(sigbus_env, 1);
+	}
+
+	/* Not caused by one of our mappings, die as usual */
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void setup_sigbus_handler(void)
+{
+	static int done = 0;
+	struct sigaction sa;
+
+	if (done)
+		return;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigbus_handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+	done = 1;
+}
+
+/* Backward scan of a mapping, returns MAP_TRUNCATED if the file got truncated
+ * while scanning it, see rscan_nl() otherwise */
+static ssize_t rscan_mapped(const char *map, size_t len, unsigned long *n_lines)
+{
+	ssize_t ret;
+
+	if (sigsetjmp(sigbus_env, 1))
+		return MAP_TRUNCATED;
+
+	sigbus_armed = 1;
+	ret = rscan_nl(map, len, n_lines);
+	sigbus_armed = 0;
+
+	return ret;
+}
+
+/*
+ * Tail a regular file using memory mappings of its trailing region instead of
+ * reading it into a buffer. The region is scanned in place and written to
+ * stdout directly from the mapping.
+ *
+ * If stdout supports copying in the kernel, only the scan is done using the
+ * mapping and the copy is left to the caller.
+ *
+ * Returns 0 and sets *offset to the offset from which the caller still needs to
+ * copy the file to stdout, or -1 if the caller should fall back to reading the
+ * file (mmap failed or the file got truncated while scanning). Nothing has
+ * been written to stdout in the latter case.
+ */
+static int tail_mmap(struct file_struct *f, unsigned long n_units, char mode, off_t *offset)
+{
+	const off_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+	char *map;
+	size_t map_len;
+	off_t pos = 0;
+
+	setup_sigbus_handler();
+
+	if (mode == M_BYTES)
+		pos = bytes_to_offset(f, n_units);
+	else {
+		unsigned long n_lines = n_units + 1;	/* We also count the last \n */
+		size_t window = scan_window(f);
+		off_t end = f->size;
+
+		while (end > 0) {
+			off_t start = 0;
+			ssize_t i;
+
+			if (end > (off_t) window)
+				start = (end - window) & ~page_mask;
+
+			map_len = end - start;
+			map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, f->fd, start);
+			if (map == MAP_FAILED)
+				return -1;
+			madvise(map, map_len, MADV_WILLNEED);
+
+			i = rscan_mapped(map, map_len, &n_lines);
+			munmap(map, map_len);
+
+			if (i == MAP_TRUNCATED) {
+				dprintf("D: File '%s' truncated while scanning mapping\n", f->name);
+				return -1;
+			} else if (i >= 0) {
+				pos = start + i + 1;	/* We don't want the first \n */
+				break;
+			}
+
+			end = start;
+			/* Long lines, use bigger windows going further back */
+			if (window < MMAP_WINDOW)
+				window *= 2;
+		}
+	}
+
+	/* splice() and friends beat writing from the mapping */
+	if (copy_method != COPY_RW) {
+		*offset = pos;
+		return 0;
+	}
+
+	if (verbose)
+		write_header(f->name);
+
+	while (pos < f->size) {
+		off_t start = pos & ~page_mask;
+		size_t skip = pos - start;
+		ssize_t rc;
+
+		map_len = f->size - start;
+		if (map_len > MMAP_WINDOW)
+			map_len = MMAP_WINDOW;
+
+		map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, f->fd, start);
+		if (map == MAP_FAILED)
+			break;	/* Let the read path copy the rest */
+		madvise(map, map_len, MADV_SEQUENTIAL);
+		madvise(map, map_len, MADV_WILLNEED);
+
+		/* Truncated pages make write() fail with EFAULT rather than
+		 * raising SIGBUS, the read path then sees EOF as usual */
+		rc = write_all(STDOUT_FILENO, map + skip, map_len - skip);
+		munmap(map, map_len);
+
+		if (rc <= 0)
+			break;
+		pos += rc;
+		if ((size_t) rc < map_len - skip)
+			break;
+	}
+
+	*offset = pos;
+	return 0;
+}
+
+/*
+ * State file
+ *
+ * With --state-file, the device, inode and offset up to which each regular
+ * file was output is recorded, one line "DEV INO OFFSET NAME" per file. The
+ * file is replaced atomically every STATE_INTERVAL while files are being
+ * output and on exit. On the next start, files continue at their recorded
+ * offsets instead of with their last N lines. If a file was replaced in the
+ * meantime, the rest of the old one is output first if it can still be found
+ * next to it.
+ */
+static int state_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct state_entry *) a)->name, ((const struct state_entry *) b)->name);
+}
+
+static void state_load(void)
+{
+	FILE *fp = fopen(state_file, "r");
+	size_t max_state = 0, len = 0;
+	char *line = NULL;
+	ssize_t rc;
+
+	if (!fp) {
+		/* First start */
+		if (errno != ENOENT)
+			fprintf(stderr, "Warning: Could not open state file '%s' (%s)\n",
+					state_file, strerror(errno));
+		return;
+	}
+
+	if (getline(&line, &len, fp) < 0 || strcmp(line, STATE_MAGIC "\n") != 0) {
+		fprintf(stderr, "Warning: Ignoring invalid state file '%s'\n", state_file);
+		goto out;
+	}
+
+	while ((rc = getline(&line, &len, fp)) > 0) {
+		unsigned long long dev, ino;
+		long long offset;
+		int name_start = 0;
+		struct state_entry *e;
+
+		if (line[rc - 1] == '\n')
+			line[--rc] = '\0';
+		/* The name starts right after the single space following the
+		 * offset, it may itself start with blanks */
+		if (sscanf(line, "%llu %llu %lld%n", &dev, &ino, &offset, &name_start) != 3 ||
+		    name_start == 0 || line[name_start] != ' ' || ++name_start == rc ||
+		    offset < 0)
+			continue;
+
+		if (n_state == max_state) {
+			max_state = max_state ? max_state * 2 : 16;
+			state = erealloc(state, max_state * sizeof(*state));
+		}
+		e = &state[n_state++];
+		e->dev = dev;
+		e->ino = ino;
+		e->offset = offset;
+		e->name = emalloc(rc - name_start + 1);
+		memcpy(e->name, line + name_start, rc - name_start + 1);
+	}
+
+	qsort(state, n_state, sizeof(*state), state_cmp);
+out:
+	free(line);
+	fclose(fp);
+}
+
+static void state_save(void)
+{
+	size_t len;
+	char *tmp;
+	FILE *fp;
+	int i, fd;
+
+	if (!state_file)
+		return;
+
+	len = strlen(state_file) + sizeof(".XXXXXX");
+	tmp = emalloc(len);
+	snprintf(tmp, len, "%s.XXXXXX", state_file);
+	fd = mkstemp(tmp);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto err;
+	}
+
+	fputs(STATE_MAGIC "\n", fp);
+	for (i = 0; i < n_files; i++) {
+		struct file_struct *f = files[i];
+
+		/* An incomplete line held back was not output yet */
+		if (f->ino && !strchr(f->name, '\n'))
+			fprintf(fp, "%llu %llu %lld %s\n", (unsigned long long) f->dev,
+					(unsigned long long) f->ino,
+					(long long) (f->size - f->carry.len), f->name);
+	}
+
+	/* Make sure the data is there before the old state is replaced */
+	if (fflush(fp) != 0 || fdatasync(fd) < 0) {
+		fclose(fp);
+		unlink(tmp);
+		goto err;
+	}
+	if (fclose(fp) != 0 || rename(tmp, state_file) < 0) {
+		unlink(tmp);
+		goto err;
+	}
+
+	state_dirty = 0;
+	free(tmp);
+	return;
+err:
+	fprintf(stderr, "Warning: Could not write state file '%s' (%s)\n", state_file, strerror(errno));
+	free(tmp);
+}
+
+/* Per file counters, see stats_write() */
+static const struct {
+	const char *name;
+	const char *help;
+	size_t offset;
+} file_metrics[] = {
+	{ "file_events_total", "inotify events handled for the file.",
+	  offsetof(struct file_stats, events) },
+	{ "file_read_bytes_total", "Bytes of the file output while following.",
+	  offsetof(struct file_stats, bytes_read) },
+	{ "file_rotations_total", "Times the file was replaced by a new one.",
+	  offsetof(struct file_stats, rotations) },
+	{ "file_truncations_total", "Times the file was truncated.",
+	  offsetof(struct file_stats, truncations) },
+};
+
+static void stats_counter(FILE *fp, const char *name, const char *help, unsigned long long val)
+{
+	fprintf(fp, "# HELP inotail_%s %s\n# TYPE inotail_%s counter\ninotail_%s %llu\n",
+			name, help, name, name, val);
+}
+
+/* Write s as a label value, escaped as the Prometheus text format wants it */
+static void stats_label(FILE *fp, const char *s)
+{
+	for (; *s; s++) {
+		if (*s == '\\' || *s == '"')
+			fputc('\\', fp);
+		if (*s == '\n')
+			fputs("\\n", fp);
+		else
+			fputc(*s, fp);
+	}
+}
+
+/* Write all counters in the Prometheus text exposition format */
+static void stats_write(FILE *fp)
+{
+	unsigned long long n = 0;
+	size_t m;
+	int i;
+
+	stats_counter(fp, "events_total", "inotify events handled.", stats.events);
+	stats_counter(fp, "read_bytes_total", "Bytes of followed files output.", stats.bytes_read);
+	stats_counter(fp, "written_bytes_total", "Bytes written to standard output.", stats.bytes_written);
+	stats_counter(fp, "dropped_bytes_total", "Bytes skipped because of --backlog-policy.",
+			stats.bytes_dropped);
+	stats_counter(fp, "syscalls_total", "System calls made for I/O and events.", stats.syscalls);
+	stats_counter(fp, "rotations_total", "Followed files replaced by new ones.", stats.rotations);
+	stats_counter(fp, "truncations_total", "Followed files truncated.", stats.truncations);
+	stats_counter(fp, "queue_overflows_total", "inotify event queue overflows.", stats.overflows);
+	stats_counter(fp, "coalesced_events_total", "Events merged by --coalesce.", stats.coalesced);
+
+	fputs("# HELP inotail_files Files being followed.\n# TYPE inotail_files gauge\n", fp);
+	fprintf(fp, "inotail_files %d\n", n_files - n_ignored);
+
+	for (m = 0; m < sizeof(file_metrics) / sizeof(file_metrics[0]); m++) {
+		fprintf(fp, "# HELP inotail_%s %s\n# TYPE inotail_%s counter\n",
+				file_metrics[m].name, file_metrics[m].help, file_metrics[m].name);
+		for (i = 0; i < n_files; i++) {
+			const char *fs = (const char *) &files[i]->stats;
+
+			fprintf(fp, "inotail_%s{file=\"", file_metrics[m].name);
+			stats_label(fp, files[i]->name);
+			fprintf(fp, "\"} %llu\n", *(const unsigned long long *) (fs + file_metrics[m].offset));
+		}
+	}
+
+	fputs("# HELP inotail_output_latency_seconds Time from the inotify event announcing "
+	      "data to writing it to standard output.\n"
+	      "# TYPE inotail_output_latency_seconds histogram\n", fp);
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		n += stats.latency[i];
+		fprintf(fp, "inotail_output_latency_seconds_bucket{le=\"%.6f\"} %llu\n",
+				(double) (1ULL << i) / 1e6, n);
+	}
+	fprintf(fp, "inotail_output_latency_seconds_bucket{le=\"+Inf\"} %llu\n", stats.latency_count);
+	fprintf(fp, "inotail_output_latency_seconds_sum %.9f\n", stats.latency_sum / 1e9);
+	fprintf(fp, "inotail_output_latency_seconds_count %llu\n", stats.latency_count);
+}
+
+/* Replace --stats-file, atomically for whoever reads it */
+static void stats_save(void)
+{
+	size_t len;
+	char *tmp;
+	FILE *fp;
+	int fd;
+
+	if (!stats_file)
+		return;
+
+	len = strlen(stats_file) + sizeof(".XXXXXX");
+	tmp = emalloc(len);
+	snprintf(tmp, len, "%s.XXXXXX", stats_file);
+	fd = mkstemp(tmp);
+	if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		goto err;
+	}
+
+	/* mkstemp() creates the file readable only by us */
+	fchmod(fd, 0644);
+	stats_write(fp);
+	if (fclose(fp) != 0 || rename(tmp, stats_file) < 0) {
+		unlink(tmp);
+		goto err;
+	}
+
+	free(tmp);
+	return;
+err:
+	fprintf(stderr, "Warning: Could not write stats file '%s' (%s)\n", stats_file, strerror(errno));
+	free(tmp);
+}
+
+/* Look for the file with the inode recorded in e next to f, i.e. where f was
+ * rotated to. Returns an fd for it or -1. */
+static int open_rotated(struct file_struct *f, const struct state_entry *e, char **path)
+{
+	const char *base = strrchr(f->name, '/');
+	int dir_len = base ? base + 1 - f->name : 0;
+	struct dirent *de;
+	struct stat finfo;
+	int fd = -1;
+	DIR *dir;
+
+	dir = base ? opendir(dir_len > 1 ? strndupa(f->name, dir_len - 1) : "/") : opendir(".");
+	if (!dir)
+		return -1;
+
+	while (fd < 0 && (de = readdir(dir))) {
+		size_t len;
+
+		if (de->d_ino != e->ino)
+			continue;
+
+		len = dir_len + strlen(de->d_name) + 1;
+		*path = emalloc(len);
+		snprintf(*path, len, "%.*s%s", dir_len, f->name, de->d_name);
+		fd = open(*path, O_RDONLY|O_LARGEFILE);
+		if (fd >= 0 && (fstat(fd, &finfo) < 0 || finfo.st_dev != e->dev ||
+				finfo.st_ino != e->ino || finfo.st_size < e->offset)) {
+			close(fd);
+			fd = -1;
+		}
+		if (fd < 0)
+			free(*path);
+	}
+
+	closedir(dir);
+	return fd;
+}
+
+/* Find where to continue f according to the state file. Returns the offset
+ * or -1 if f is to be tailed as usual. */
+static off_t state_resume(struct file_struct *f, const struct stat *finfo)
+{
+	struct state_entry key, *e;
+	struct file_struct old;
+
+	key.name = f->name;
+	e = bsearch(&key, state, n_state, sizeof(*state), state_cmp);
+	if (!e)
+		return -1;
+
+	if (e->dev == finfo->st_dev && e->ino == finfo->st_ino) {
+		if (e->offset <= finfo->st_size)
+			return e->offset;
+
+		fprintf(stderr, "File '%s' truncated\n", f->name);
+		return 0;
+	}
+
+	/* Replaced, output the rest of the old file if it is still around */
+	setup_file(&old);
+	old.fd = open_rotated(f, e, &old.name);
+	if (old.fd >= 0) {
+		fprintf(stderr, "File '%s' has been replaced, resuming with '%s'\n", f->name, old.name);
+		if (verbose)
+			write_header(f->name);
+		old.size = e->offset;
+		old.mode = S_IFREG;
+		copy_to_stdout(&old, COPY_ALL);
+		filter_flush(&old.carry, stdout_sink, NULL);
+		free(old.carry.buf);
+		free(old.name);
+		close(old.fd);
+	} else
+		fprintf(stderr, "File '%s' has been replaced, following new file.\n", f->name);
+
+	return 0;
+}
+
+/*
+ * Prefetching
+ *
+ * Tailing many files one after the other mostly means waiting for the disk,
+ * one file at a time. So with --prefetch, all files are opened and the part of
+ * each tail_file() is going to read first is read ahead, with PREFETCH_DEPTH
+ * files in flight at once. This is done through io_uring if the kernel
+ * supports it, otherwise by a pool of threads. tail_file() then continues with
+ * the open file and finds the data in the page cache, outputting the files in
+ * the order they were given as before.
+ */
+static int uring_init(struct uring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	/* Both rings in one mapping? */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_len > r->sq_ring_len)
+			r->sq_ring_len = r->cq_ring_len;
+		r->cq_ring_len = 0;
+	}
+
+	r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			  r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = r->cq_ring_len == 0 ? r->sq_ring :
+		mmap(NULL, r->cq_ring_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		     r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+		if (r->sq_ring != MAP_FAILED)
+			munmap(r->sq_ring, r->sq_ring_len);
+		if (r->cq_ring_len && r->cq_ring != MAP_FAILED)
+			munmap(r->cq_ring, r->cq_ring_len);
+		if (r->sqes != MAP_FAILED)
+			munmap(r->sqes, r->sqes_len);
+		close(r->fd);
+		return -1;
+	}
+
+	r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+	r->tail = *r->sq_tail;
+	r->to_submit = 0;
+
+	return 0;
+}
+
+static void uring_exit(struct uring *r)
+{
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_ring_len)
+		munmap(r->cq_ring, r->cq_ring_len);
+	munmap(r->sq_ring, r->sq_ring_len);
+	close(r->fd);
+}
+
+/* Next free submission queue entry, the caller makes sure there is one */
+static struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	unsigned idx = r->tail++ & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	r->sq_array[idx] = idx;
+	memset(sqe, 0, sizeof(*sqe));
+	r->to_submit++;
+
+	return sqe;
+}
+
+/* Submit the queued entries and wait for at least one completion */
+static int uring_enter(struct uring *r)
+{
+	long rc;
+
+	__atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+	do
+		rc = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	while (rc < 0 && errno == EINTR);
+
+	if (rc < 0)
+		return -1;
+	r->to_submit -= rc;
+	return 0;
+}
+
+static inline int prefetchable(const struct file_struct *f)
+{
+	return f->fd < 0 && strcmp(f->name, "-") != 0;
+}
+
+/* Where tail_file() is going to read f first */
+static off_t prefetch_offset(off_t size, unsigned long n_units, char mode)
+{
+	if (mode == M_BYTES) {
+		if (from_begin)
+			return n_units;
+		return (off_t) n_units < size ? size - (off_t) n_units : 0;
+	}
+
+	if (from_begin && !since_arg)
+		return 0;
+	return size > SCAN_WINDOW ? size - SCAN_WINDOW : 0;
+}
+
+/* Keep fd opened for f if it is a regular file. Returns the offset to read
+ * ahead from or -1 if there is nothing to read. */
+static off_t prefetch_opened(struct file_struct *f, int fd, const struct prefetch_job *job)
+{
+	struct stat finfo;
+	off_t offset;
+
+	if (fd < 0)
+		return -1;
+
+	/* Opened with O_NONBLOCK so FIFOs don't block, tail_file() opens
+	 * anything but regular files again itself */
+	if (fstat(fd, &finfo) < 0 || !S_ISREG(finfo.st_mode) || fcntl(fd, F_SETFL, 0) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	f->fd = fd;
+	offset = prefetch_offset(finfo.st_size, job->n_units, job->mode);
+
+	return offset < finfo.st_size ? offset : -1;
+}
+
+static int prefetch_uring(struct prefetch_job *job)
+{
+	struct prefetch_slot slots[PREFETCH_DEPTH];
+	int free_slots[PREFETCH_DEPTH];
+	int i, n_free = PREFETCH_DEPTH;
+	struct uring r;
+
+	if (uring_init(&r, PREFETCH_DEPTH) < 0)
+		return -1;
+
+	for (i = 0; i < PREFETCH_DEPTH; i++) {
+		slots[i].buf = NULL;
+		free_slots[i] = i;
+	}
+
+	while (job->next < n_files || n_free < PREFETCH_DEPTH) {
+		unsigned head, tail;
+
+		/* Start opening more files */
+		while (n_free > 0 && job->next < n_files) {
+			struct file_struct *f = files[job->next];
+			struct io_uring_sqe *sqe;
+			int s;
+
+			if (!prefetchable(f)) {
+				job->next++;
+				continue;
+			}
+
+			s = free_slots[--n_free];
+			slots[s].file = job->next++;
+			slots[s].reading = 0;
+			sqe = uring_sqe(&r);
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long) f->name;
+			sqe->open_flags = O_RDONLY|O_LARGEFILE|O_NONBLOCK;
+			sqe->user_data = s;
+		}
+
+		if (n_free == PREFETCH_DEPTH)
+			break;
+
+		if (uring_enter(&r) < 0) {
+			/* The kernel might still be writing to the buffers,
+			 * so leave them be. The files not opened yet are
+			 * opened by tail_file(). */
+			dprintf("D: Could not submit to io_uring (%s)\n", strerror(errno));
+			return 0;
+		}
+
+		head = *r.cq_head;
+		tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &r.cqes[head & *r.cq_mask];
+			struct prefetch_slot *slot = &slots[cqe->user_data];
+			struct file_struct *f = files[slot->file];
+			off_t offset;
+
+			if (!slot->reading && (offset = prefetch_opened(f, cqe->res, job)) >= 0) {
+				struct io_uring_sqe *sqe = uring_sqe(&r);
+
+				if (!slot->buf)
+					slot->buf = emalloc(SCAN_WINDOW);
+				slot->reading = 1;
+				sqe->opcode = IORING_OP_READ;
+				sqe->fd = f->fd;
+				sqe->addr = (unsigned long) slot->buf;
+				sqe->len = SCAN_WINDOW;
+				sqe->off = offset;
+				sqe->user_data = cqe->user_data;
+				continue;
+			}
+
+			/* Done with the file, the data read is not needed */
+			free_slots[n_free++] = cqe->user_data;
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	for (i = 0; i < PREFETCH_DEPTH; i++)
+		free(slots[i].buf);
+	uring_exit(&r);
+
+	return 0;
+}
+
+static void *prefetch_thread(void *arg)
+{
+	struct prefetch_job *job = arg;
+	char *buf = emalloc(SCAN_WINDOW);
+	int i;
+
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < n_files) {
+		struct file_struct *f = files[i];
+		off_t offset;
+
+		if (prefetchable(f) &&
+		    (offset = prefetch_opened(f, open(f->name, O_RDONLY|O_LARGEFILE|O_NONBLOCK), job)) >= 0 &&
+		    pread(f->fd, buf, SCAN_WINDOW, offset) < 0)
+			dprintf("D: Could not read ahead '%s' (%s)\n", f->name, strerror(errno));
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Open the files and read ahead what tail_file() needs for them first */
+static void prefetch_files(unsigned long n_units, char mode)
+{
+	struct prefetch_job job = { n_units, mode, 0 };
+	long n = n_threads > 0 ? n_threads : PREFETCH_THREADS;
+	pthread_t *threads;
+	long i, n_started;
+
+	if (prefetch_uring(&job) == 0) {
+		dprintf("D: Prefetched %d files using io_uring\n", n_files);
+		return;
+	}
+
+	if (n > n_files)
+		n = n_files;
+	threads = emalloc(n * sizeof(pthread_t));
+
+	/* We're prefetching, too */
+	for (n_started = 0; n_started < n - 1; n_started++)
+		if (pthread_create(&threads[n_started], NULL, prefetch_thread, &job) != 0)
+			break;
+	prefetch_thread(&job);
+	for (i = 0; i < n_started; i++)
+		pthread_join(threads[i], NULL);
+
+	dprintf("D: Prefetched %d files using %ld threads\n", n_files, n_started + 1);
+	free(threads);
+}
+
+static int tail_file(struct file_struct *f, unsigned long n_units, char mode)
+{
+	off_t offset = 0, end = 0, len = COPY_ALL;
+	struct stat finfo;
+
+	if (strcmp(f->name, "-") == 0)
+		f->fd = STDIN_FILENO;
+	else if (f->fd < 0) {
+		/* Not opened by prefetch_files() already */
+		f->fd = open(f->name, O_RDONLY|O_LARGEFILE);
+		if (unlikely(f->fd < 0)) {
+			fprintf(stderr, "Error: Could not open file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		}
+	}
+
+	if (fstat(f->fd, &finfo) < 0) {
+		fprintf(stderr, "Error: Could not stat file '%s' (%s)\n", f->name, strerror(errno));
+		return -1;
+	}
+
+	if (!IS_TAILABLE(finfo.st_mode)) {
+		fprintf(stderr, "Error: '%s' of unsupported file type\n", f->name);
+		return -1;
+	}
+	f->mode = finfo.st_mode;
+
+	/* Cannot seek on these */
+	if (IS_PIPELIKE(finfo.st_mode) || f->fd == STDIN_FILENO) {
+		if (since_arg || until_arg)
+			fprintf(stderr, "Warning: --since and --until have no effect on non-seekable '%s'\n",
+					pretty_name(f->name));
+		if (verbose)
+			write_header(f->name);
+
+		return tail_pipe(f, n_units, mode);
+	}
+
+	f->size = finfo.st_size;
+	if (likely(finfo.st_blksize > 0))
+		f->blksize = finfo.st_blksize;
+	if (S_ISREG(finfo.st_mode)) {
+		f->dev = finfo.st_dev;
+		f->ino = finfo.st_ino;
+		f->sparse = is_sparse(f, &finfo);
+	}
+
+	/* Size the I/O buffer for the largest block size before following */
+	io_buffer(scan_window(f));
+
+	if (nocache && S_ISREG(finfo.st_mode)) {
+		if (direct_io)
+			direct_open(f);
+		advise(f, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	if (until_arg) {
+		/* The last second of until is included. The output ends there,
+		 * so the last lines are the ones before it. */
+		end = time_to_offset(f, until + 1);
+		if (unlikely(end < 0)) {
+			direct_close();
+			return -1;
+		}
+		f->size = end;
+	}
+
+	if (state_file && S_ISREG(finfo.st_mode) && (offset = state_resume(f, &finfo)) >= 0) {
+		/* Continue where the last run left off */
+	} else if (S_ISREG(finfo.st_mode) && f->size >= MMAP_THRESHOLD && !nocache && !f->sparse &&
+	    !(mode == M_LINES && from_begin) && !since_arg && !until_arg && !filtering &&
+	    tail_mmap(f, n_units, mode, &offset) == 0) {
+		/* Everything written from the mapping? */
+		if (offset == f->size)
+			goto out;
+	} else {
+		if (since_arg)
+			offset = time_to_offset(f, since);
+		else if (mode == M_LINES)
+			offset = lines_to_offset(f, n_units);
+		else
+			offset = bytes_to_offset(f, n_units);
+
+		/* We only get negative offsets on errors */
+		if (unlikely(offset < 0)) {
+			direct_close();
+			return -1;
+		}
+	}
+
+	/* Not all character devices are seekable */
+	if (!S_ISREG(finfo.st_mode) && lseek(f->fd, offset, SEEK_SET) == (off_t) -1) {
+		fprintf(stderr, "Error: Could not seek in file '%s' (%s)\n", f->name, strerror(errno));
+		return -1;
+	}
+
+	if (until_arg)
+		len = end > offset ? end - offset : 0;
+
+	if (verbose)
+		write_header(f->name);
+
+	/* Follow from wherever copying stopped */
+	f->size = offset;
+	f->dropped = offset;
+	copy_data(f, len);
+	if (S_ISREG(finfo.st_mode))
+		drop_behind(f, &f->dropped, f->size, 1);
+	direct_close();
+	/* The last line is complete unless it can still grow */
+	if (!follow)
+		filter_flush(&f->carry, stdout_sink, NULL);
+out:
+	if (!follow) {
+		if (close(f->fd) < 0) {
+			fprintf(stderr, "Error: Could not close file '%s' (%s)\n", f->name, strerror(errno));
+			return -1;
+		}
+	}
+	/* Let the fd open otherwise, we'll need it */
+
+	return 0;
+}
+
+/* Output an incomplete last line of f held back, see filter_flush() */
+static void flush_line(struct file_struct *f)
+{
+	filter_flush(&f->carry, line_atomic ? queue_sink : stdout_sink, f);
+}
+
+/* Position of the first line starting at or after offset in f, if it is close */
+static off_t next_line_start(struct file_struct *f, off_t offset, off_t end)
+{
+	char *buf = io_buffer(f->blksize);
+	ssize_t rc = pread(f->fd, buf, copy_len(end, offset, io_buf.size), offset);
+	char *nl;
+
+	if (rc > 0 && (nl = memchr(buf, '\n', rc)))
+		offset += nl + 1 - buf;
+
+	return offset;
+}
+
+/* Don't let f fall more than max_backlog bytes behind, see --backlog-policy.
+ * Only regular files are affected, pipes just fill up and block the writer. */
+static void limit_backlog(struct file_struct *f, const struct stat *finfo)
+{
+	off_t to;
+	char c;
+
+	if (backlog_policy == BACKLOG_BLOCK || !S_ISREG(finfo->st_mode) ||
+	    finfo->st_size - f->size <= max_backlog)
+		return;
+
+	if (backlog_policy == BACKLOG_SKIP) {
+		to = finfo->st_size;
+		f->skipped += to - f->size;
+	} else
+		to = next_line_start(f, finfo->st_size - max_backlog, finfo->st_size);
+
+	/* Unless filtering, lines are output as they come, so we might be
+	 * cutting one short */
+	if (!(filtering || line_atomic) && f->size > 0 &&
+	    pread(f->fd, &c, 1, f->size - 1) == 1 && c != '\n')
+		f->cut = 1;
+
+	dprintf("D: Dropping %lld bytes of '%s'\n", (long long) (to - f->size), f->name);
+	stats.bytes_dropped += to - f->size;
+	f->size = to;
+	f->carry.len = 0;
+}
+
+/* Tell where output of f was skipped with --backlog-policy=skip, ending a line
+ * cut short by limit_backlog() first */
+static void write_skip_marker(struct file_struct *f)
+{
+	char marker[PATH_MAX + 64];
+	int len = 0;
+
+	if (f->cut)
+		marker[len++] = '\n';
+	if (f->skipped)
+		len += snprintf(marker + len, sizeof(marker) - len, "[inotail: skipped %lld bytes of %s]\n",
+				(long long) f->skipped, pretty_name(f->name));
+
+	if (len >= (int) sizeof(marker))
+		len = sizeof(marker) - 1;
+	if (line_atomic) {
+		if (verbose)
+			write_header(f->name);
+		out_append(marker, len);
+	} else
+		out_write(marker, len);
+	f->skipped = 0;
+	f->cut = 0;
+}
+
+static int stat_file(struct file_struct *f, struct stat *finfo)
+{
+	stats.syscalls++;
+	if (fstat(f->fd, finfo) < 0) {
+		fprintf(stderr, "Error: Could not stat file '%s' (%s)\n", f->name, strerror(errno));
+		ignore_file(f);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start over at the new end of f if it got truncated, returns whether it was */
+static int check_truncated(struct file_struct *f, const struct stat *finfo)
+{
+	if (finfo->st_size >= f->size)
+		return 0;
+
+	fprintf(stderr, "File '%s' truncated\n", f->name);
+	f->stats.truncations++;
+	stats.truncations++;
+	f->size = finfo->st_size;
+	flush_line(f);
+
+	return 1;
+}
+
+/* Files with more data pending than they got to output in their turn */
+static struct file_struct *ready_head = NULL;
+static struct file_struct **ready_tail = &ready_head;
+
+static void make_ready(struct file_struct *f)
+{
+	f->ready = 1;
+	f->ready_next = NULL;
+	*ready_tail = f;
+	ready_tail = &f->ready_next;
+}
+
+/*
+ * Output up to max bytes (or everything for COPY_ALL) of what got appended to
+ * f since we last looked. If f has more to output, it is put into the ready
+ * queue to continue in its next turn. Catching up with everything also outputs
+ * an incomplete last line held back by the filters.
+ */
+static int follow_file(struct file_struct *f, off_t max)
+{
+	off_t copied;
+	struct stat finfo;
+	char blocking = out_blocking;
+
+	/* Only needs to know how far behind it is upfront if it may fall
+	 * behind just so far */
+	if (backlog_policy != BACKLOG_BLOCK && S_ISREG(f->mode)) {
+		if (stat_file(f, &finfo) < 0)
+			return -1;
+		check_truncated(f, &finfo);
+		limit_backlog(f, &finfo);
+	}
+
+	/* Wait for stdout to take more, just keeping track of how far behind
+	 * we are meanwhile */
+	if (out_stalled && max != COPY_ALL) {
+		if (!f->ready)
+			make_ready(f);
+		return 0;
+	}
+
+	/* Otherwise the header goes with the lines, see queue_sink() */
+	if (verbose && !line_atomic)
+		write_header(f->name);
+
+	if (f->skipped || f->cut)
+		write_skip_marker(f);
+
+	/* Catching up before letting go of the file, either wait for stdout or
+	 * queue the (bounded) rest */
+	if (max == COPY_ALL && backlog_policy == BACKLOG_BLOCK && !out_blocking) {
+		out_blocking = 1;
+		if (out_stalled)
+			out_stall(0);
+		out_flush();
+	}
+
+	copied = copy_data(f, max);
+	/* Nothing new, maybe because the file got truncated */
+	if (copied == 0 && S_ISREG(f->mode) && !out_stalled) {
+		if (stat_file(f, &finfo) < 0) {
+			out_blocking = blocking;
+			return -1;
+		}
+		if (check_truncated(f, &finfo))
+			copied = copy_data(f, max);
+	}
+	f->stats.bytes_read += copied;
+	stats.bytes_read += copied;
+	out_blocking = blocking;
+	state_dirty = 1;
+
+	if (max == COPY_ALL)
+		flush_line(f);
+	else if ((copied == max || out_stalled) && !f->ready)
+		make_ready(f);
+
+	/* Caught up, what got announced since f->since is written or queued */
+	if (!f->ready && f->since) {
+		if (copied > 0 && out.len == 0)
+			stats_latency(f->since);
+		else if (copied > 0 && (!out_since || f->since < out_since))
+			out_since = f->since;
+		f->since = 0;
+	}
+
+	return 0;
+}
+
+/* Give f a turn to output new data, unless it is already waiting for one.
+ * While stdout is stalled, this only checks on its backlog. */
+static int schedule_file(struct file_struct *f)
+{
+	if (!f->since)
+		f->since = event_time;
+	if (f->ready && !out_stalled)
+		return 0;
+
+	return follow_file(f, FOLLOW_QUANTUM);
+}
+
+/* Give each file in the ready queue one more turn */
+static void run_ready(void)
+{
+	struct file_struct *f = ready_head;
+
+	/* Files running out of their quantum again queue up for the next round */
+	ready_head = NULL;
+	ready_tail = &ready_head;
+
+	while (f) {
+		struct file_struct *next = f->ready_next;
+
+		f->ready = 0;
+		if (f->idx < 0)
+			free_file(f);
+		else if (!f->ignore && f->fd >= 0)
+			follow_file(f, FOLLOW_QUANTUM);
+		f = next;
+	}
+}
+
+/* f got appended to. With --coalesce, where f may show up many times in the
+ * events read at once, it just gets a turn after them. */
+static int file_modified(struct file_struct *f)
+{
+	/* Keep an eye on the backlog while stdout is stalled */
+	if (!coalesce_delay || out_stalled)
+		return schedule_file(f);
+
+	if (!f->since)
+		f->since = event_time;
+	if (f->ready)
+		stats.coalesced++;
+	else
+		make_ready(f);
+
+	return 0;
+}
+
+/* A file followed by name (re)appeared, switch over to it */
+static int reopen_file(struct file_struct *f)
+{
+	struct stat finfo;
+	int fd;
+
+	fd = open(f->name, O_RDONLY|O_LARGEFILE);
+	if (fd < 0) {
+		/* Gone again already, wait for it to reappear */
+		if (errno == ENOENT)
+			return 0;
+
+		fprintf(stderr, "Error: Could not open file '%s' (%s)\n", f->name, strerror(errno));
+		ignore_file(f);
+		return -1;
+	}
+
+	if (f->fd >= 0) {
+		/* Catch up with whatever got written to the old file in the
+		 * meantime before letting go of it */
+		follow_file(f, COPY_ALL);
+		close(f->fd);
+		fprintf(stderr, "File '%s' has been replaced, following new file.\n", f->name);
+		f->stats.rotations++;
+		stats.rotations++;
+	} else
+		fprintf(stderr, "File '%s' has appeared, following it.\n", f->name);
+
+	f->fd = fd;
+	f->size = 0;
+	if (fstat(fd, &finfo) == 0) {
+		if (finfo.st_blksize > 0)
+			f->blksize = finfo.st_blksize;
+		f->mode = finfo.st_mode;
+		f->dev = S_ISREG(finfo.st_mode) ? finfo.st_dev : 0;
+		f->ino = S_ISREG(finfo.st_mode) ? finfo.st_ino : 0;
+		f->sparse = S_ISREG(finfo.st_mode) && is_sparse(f, &finfo);
+	}
+	state_dirty = 1;
+
+	return schedule_file(f);
+}
+
+/* Event on the watch of a file followed by descriptor */
+static int handle_file_event(struct inotify_event *inev, struct file_struct *f)
+{
+	f->stats.events++;
+	if (inev->mask & IN_MODIFY)
+		return file_modified(f);
+
+	if (inev->mask & IN_MOVE_SELF) {
+		/* We still have the descriptor, so just keep following it */
+		fprintf(stderr, "File '%s' moved.\n", f->name);
+		return 0;
+	}
+
+	if (inev->mask & IN_DELETE_SELF) {
+		fprintf(stderr, "File '%s' deleted.\n", f->name);
+		follow_file(f, COPY_ALL);
+	} else if (inev->mask & IN_UNMOUNT)
+		fprintf(stderr, "Device containing file '%s' unmounted.\n", f->name);
+	else if (!(inev->mask & IN_IGNORED))
+		return 0;
+
+	ignore_file(f);
+	return -1;
+}
+
+/*
+ * --glob
+ *
+ * Only the last component of a pattern may contain wildcards, so the files
+ * matching it are all in one directory. The files matching at startup are
+ * tailed like the ones given as arguments. While following, the directory is
+ * watched and files appearing in it which match are followed from their
+ * beginning, deleted ones are dropped. The files share the watch on the
+ * directory, so there is no inotify watch per file.
+ */
+static void add_glob(const char *arg)
+{
+	struct glob_pat *g = emalloc(sizeof(struct glob_pat)), **tail;
+	const char *slash = strrchr(arg, '/');
+	struct stat finfo;
+	size_t len = strlen(arg);
+
+	if (stat(arg, &finfo) == 0 && S_ISDIR(finfo.st_mode)) {
+		/* All files in the directory */
+		g->prefix = emalloc(len + 2);
+		snprintf(g->prefix, len + 2, "%s%s", arg, (len > 0 && arg[len - 1] == '/') ? "" : "/");
+		g->pattern = "*";
+	} else {
+		len = slash ? slash + 1 - arg : 0;
+		g->prefix = emalloc(len + 1);
+		memcpy(g->prefix, arg, len);
+		g->prefix[len] = '\0';
+		g->pattern = arg + len;
+	}
+
+	if (strpbrk(g->prefix, "*?[") || *g->pattern == '\0') {
+		fprintf(stderr, "Error: Only the last component of --glob patterns may contain wildcards: %s\n",
+				arg);
+		exit(EXIT_FAILURE);
+	}
+
+	g->dir = NULL;
+	g->next = NULL;
+	for (tail = &globs; *tail; tail = &(*tail)->next)
+		;
+	*tail = g;
+}
+
+/* Path of the directory the files matching g are in */
+static char *glob_dir_path(const struct glob_pat *g)
+{
+	size_t len = strlen(g->prefix);
+	char *path;
+
+	if (len == 0)
+		path = strdup(".");
+	else if (len == 1)
+		path = strdup("/");
+	else
+		path = strndup(g->prefix, len - 1);
+	if (unlikely(!path)) {
+		fprintf(stderr, "Error: Failed to allocate memory (%s)\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return path;
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Add the files currently matching g, sorted by name */
+static void expand_glob(const struct glob_pat *g)
+{
+	char *path = glob_dir_path(g), **names = NULL;
+	size_t i, n_names = 0, max_names = 0;
+	const struct glob_pat *prev;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Error: Could not open directory '%s' (%s)\n", path, strerror(errno));
+		free(path);
+		return;
+	}
+
+	while ((de = readdir(dir))) {
+		if (de->d_type == DT_DIR || fnmatch(g->pattern, de->d_name, FNM_PERIOD) != 0)
+			continue;
+
+		/* Already added for an earlier pattern? */
+		for (prev = globs; prev != g; prev = prev->next)
+			if (strcmp(prev->prefix, g->prefix) == 0 &&
+			    fnmatch(prev->pattern, de->d_name, FNM_PERIOD) == 0)
+				break;
+		if (prev != g)
+			continue;
+
+		if (n_names == max_names) {
+			max_names = max_names ? max_names * 2 : 64;
+			names = erealloc(names, max_names * sizeof(char *));
+		}
+		i = strlen(g->prefix) + strlen(de->d_name) + 1;
+		names[n_names] = emalloc(i);
+		snprintf(names[n_names++], i, "%s%s", g->prefix, de->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, n_names, sizeof(char *), name_cmp);
+	for (i = 0; i < n_names; i++)
+		add_file(names[i])->glob = 1;
+
+	free(names);
+	free(path);
+}
+
+/* Every followed file needs a descriptor, allow for as many as we may */
+static void raise_nofile_limit(void)
+{
+	struct rlimit rl;
 
-	return 0;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			dprintf("D: Could not raise file descriptor limit (%s)\n", strerror(errno));
+	}
 }
 
-static int tail_pipe_lines(struct file_struct *f, unsigned long n_lines)
+/* Start following the file name which appeared in d if it matches --glob */
+static int add_glob_file(struct dir_struct *d, const char *name)
 {
-	struct line_buf {
-		char buf[BUFSIZ];
-		size_t n_lines;
-		size_t n_bytes;
-		struct line_buf *next;
-	} *first, *last, *tmp;
-	int rc;
-	unsigned long total_lines = 0;
-	const char *p;
+	struct file_struct *f;
+	struct glob_pat *g;
+	size_t len;
+	char *path;
 
-	if (from_begin)
-		return tail_pipe_from_begin(f, n_lines, M_LINES);
+	for (g = globs; g; g = g->next)
+		if (g->dir == d && fnmatch(g->pattern, name, FNM_PERIOD) == 0)
+			break;
+	if (!g)
+		return 0;
 
-	if (n_lines == 0)
-		return 0;	/* No lines to tail */
+	len = strlen(g->prefix) + strlen(name) + 1;
+	path = emalloc(len);
+	snprintf(path, len, "%s%s", g->prefix, name);
+
+	f = add_file(path);
+	f->glob = 1;
+	if (attach_dir(f) < 0) {
+		remove_file(f);
+		return -1;
+	}
 
-	first = last = emalloc(sizeof(struct line_buf));
-	first->n_bytes = first->n_lines = 0;
-	first->next = NULL;
-	tmp = emalloc(sizeof(struct line_buf));
+	/* All of it is new */
+	return reopen_file(f);
+}
 
-	while (1) {
-		if ((rc = read(f->fd, tmp->buf, BUFSIZ)) <= 0) {
-			if (rc < 0 && (errno == EINTR || errno == EAGAIN))
+/* Event on the watch of a directory containing files followed by name */
+static int handle_dir_event(struct inotify_event *inev, struct dir_struct *d)
+{
+	struct file_struct *f, *next;
+	struct glob_pat *g;
+	int i, ret = 0;
+
+	if (inev->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_IGNORED)) {
+		/* The directory is gone, and so are its files. Hold on to it
+		 * until we are done with them. */
+		fprintf(stderr, "Directory '%s' %s.\n", d->path,
+				(inev->mask & IN_UNMOUNT) ? "unmounted" : "removed");
+		d->refs++;
+		for (i = n_files - 1; i >= 0; i--) {
+			if (files[i]->dir != d)
 				continue;
+			if (files[i]->glob)
+				remove_file(files[i]);
 			else
-				break;	/* No more data to read */
-		}
-		tmp->n_bytes = rc;
-		tmp->n_lines = 0;
-		tmp->next = NULL;
-		p = tmp->buf;
-
-		/* Count the lines in the current buffer */
-		while ((p = memchr(p, '\n', tmp->buf + rc - p))) {
-			++p;
-			++tmp->n_lines;
-		}
-		total_lines += tmp->n_lines;
-
-		/* Try to append to the previous buffer if there's enough free
-		 * space
-		 */
-		if (tmp->n_bytes + last->n_bytes < BUFSIZ) {
-			memcpy(&last->buf[last->n_bytes], tmp->buf, tmp->n_bytes);
-			last->n_bytes += tmp->n_bytes;
-			last->n_lines += tmp->n_lines;
-		} else {
-			/* Add buffer to the list */
-			last->next = tmp;
-			last = last->next;
-			/* We read more than n_lines lines, reuse the first
-			 * buffer.
-			 */
-			if (total_lines - first->n_lines > n_lines) {
-				tmp = first;
-				total_lines -= first->n_lines;
-				first = first->next;
-			} else
-				tmp = emalloc(sizeof(struct line_buf));
+				ignore_file(files[i]);
 		}
+		for (g = globs; g; g = g->next) {
+			if (g->dir == d) {
+				g->dir = NULL;
+				n_globs--;
+				put_dir(d);
+			}
+		}
+		put_dir(d);
+		return -1;
 	}
 
-	free(tmp);
+	if (inev->len == 0)
+		return 0;
 
-	if (rc < 0) {
-		fprintf(stderr, "Error: Could not read from %s\n", pretty_name(f->name));
-		goto out;
+	f = next_file_by_name(d, inev->name, NULL);
+	/* A new file matching --glob? */
+	if (!f && n_globs > 0 && (inev->mask & (IN_CREATE|IN_MOVED_TO)) && !(inev->mask & IN_ISDIR))
+		return add_glob_file(d, inev->name);
+
+	for (; f; f = next) {
+		/* f might get ignored and unhashed */
+		next = next_file_by_name(d, inev->name, f);
+		f->stats.events++;
+
+		if (inev->mask & IN_MODIFY) {
+			if (f->fd >= 0)
+				ret = file_modified(f);
+		} else if (inev->mask & (IN_CREATE|IN_MOVED_TO)) {
+			ret = reopen_file(f);
+		} else if (f->glob && (inev->mask & IN_DELETE)) {
+			/* Files matching --glob come and go */
+			fprintf(stderr, "File '%s' deleted.\n", f->name);
+			if (f->fd >= 0)
+				follow_file(f, COPY_ALL);
+			remove_file(f);
+		} else if (inev->mask & (IN_DELETE|IN_MOVED_FROM)) {
+			fprintf(stderr, "File '%s' %s, waiting for it to reappear.\n", f->name,
+					(inev->mask & IN_DELETE) ? "deleted" : "moved");
+			/* Keep the descriptor until the file reappears, the
+			 * writer might still be appending to it */
+			if (f->fd >= 0)
+				ret = schedule_file(f);
+		}
 	}
 
-	if (last->n_bytes == 0)
-		goto out;
-
-	/* Count incomplete lines */
-	if (last->buf[last->n_bytes - 1] != '\n') {
-		++last->n_lines;
-		++total_lines;
-	}
+	return ret;
+}
 
-	/* Skip unneeded buffers */
-	for (tmp = first; total_lines - tmp->n_lines > n_lines; tmp = tmp->next)
-		total_lines -= tmp->n_lines;
+/* Events got lost, find out what happened to the files by looking at them */
+static void resync_files(void)
+{
+	int i;
 
-	p = tmp->buf;
+	stats.overflows++;
+	fprintf(stderr, "Warning: inotify event queue overflowed (%llu time%s), resynchronizing files\n",
+			stats.overflows, stats.overflows == 1 ? "" : "s");
 
-	/* Read too many lines, advance */
-	if (total_lines > n_lines) {
-		unsigned long j;
-		for (j = total_lines - n_lines; j; --j) {
-			p = memchr(p, '\n', tmp->buf + tmp->n_bytes - p);
-			++p;
-		}
-	}
+	for (i = 0; i < n_files; i++) {
+		struct file_struct *f = files[i];
+		struct stat finfo, ninfo;
 
-	if ((rc = write(STDOUT_FILENO, p, tmp->buf + tmp->n_bytes - p)) <= 0) {
-		/* e.g. when writing to a pipe which gets closed */
-		if (rc)
-			fprintf(stderr, "Error: Could not write to stdout (%s)\n", strerror(errno));
-		goto out;
-	}
+		if (f->ignore)
+			continue;
 
-	for (tmp = tmp->next; tmp; tmp = tmp->next)
-		if ((rc = write(STDOUT_FILENO, tmp->buf, tmp->n_bytes)) <= 0) {
-			if (rc)
-				fprintf(stderr, "Error: Could not write to stdout (%s)\n", strerror(errno));
-			goto out;
-		}
+		if ((follow == FOLLOW_NAME || f->glob) && stat(f->name, &ninfo) == 0) {
+			/* Missed the file (re)appearing under its name */
+			if (f->fd < 0 || fstat(f->fd, &finfo) < 0 ||
+			    finfo.st_dev != ninfo.st_dev || finfo.st_ino != ninfo.st_ino) {
+				reopen_file(f);
+				continue;
+			}
+		} else if (f->fd < 0 || fstat(f->fd, &finfo) < 0)
+			continue;
 
-	rc = 0;
-out:
-	while (first) {
-		tmp = first->next;
-		free(first);
-		first = tmp;
+		/* Missed a modification or truncation. Pipes will get the next
+		 * IN_MODIFY anyway, don't block reading them here. */
+		if (S_ISREG(finfo.st_mode) && finfo.st_size != f->size)
+			schedule_file(f);
 	}
-
-	return rc;
 }
 
-/* TODO: Merge some parts (especially buffer handling) with tail_pipe_lines() */
-static int tail_pipe_bytes(struct file_struct *f, unsigned long n_bytes)
+static void add_source(struct ev_source *src, void (*handler)(struct ev_source *, unsigned))
 {
-	struct char_buf {
-		char buf[BUFSIZ];
-		size_t n_bytes;
-		struct char_buf *next;
-	} *first, *last, *tmp;
-	int rc;
-	unsigned long total_bytes = 0;
-	unsigned long i = 0;		/* Index into buffer */
+	struct epoll_event ev;
 
-	if (from_begin)
-		return tail_pipe_from_begin(f, n_bytes, M_BYTES);
+	src->handler = handler;
+	ev.events = EPOLLIN;
+	ev.data.ptr = src;
 
-	/* XXX: Needed? */
-	if (n_bytes == 0)
-		return 0;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		fprintf(stderr, "Error: Could not add event source to epoll (%s)\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
 
-	first = last = emalloc(sizeof(struct char_buf));
-	first->n_bytes = 0;
-	first->next = NULL;
-	tmp = emalloc(sizeof(struct char_buf));
+/* Set up a timer firing every interval nanoseconds as event source */
+static void add_timer(struct ev_source *src, void (*handler)(struct ev_source *, unsigned),
+		      long long interval)
+{
+	struct itimerspec its;
 
-	while(1) {
-		if ((rc = read(f->fd, tmp->buf, BUFSIZ)) <= 0) {
-			if (rc < 0 && (errno == EINTR || errno == EAGAIN))
-				continue;
-			else
-				break;	/* No more data to read */
-		}
-		total_bytes += rc;
-		tmp->n_bytes = rc;
-		tmp->next = NULL;
-
-		/* Try to append to the previous buffer if there's enough free
-		 * space
-		 */
-		if (tmp->n_bytes + last->n_bytes < BUFSIZ) {
-			memcpy(&last->buf[last->n_bytes], tmp->buf, tmp->n_bytes);
-			last->n_bytes += tmp->n_bytes;
-		} else {
-			/* Add buffer to the list */
-			last->next = tmp;
-			last = last->next;
-			/* We read more than n_bytess bytes, reuse the first
-			 * buffer.
-			 */
-			if (total_bytes - first->n_bytes > n_bytes) {
-				tmp = first;
-				total_bytes -= first->n_bytes;
-				first = first->next;
-			} else
-				tmp = emalloc(sizeof(struct char_buf));
-		}
+	src->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (src->fd < 0) {
+		fprintf(stderr, "Error: Could not create timer (%s)\n", strerror(errno));
+		exit(EXIT_FAILURE);
 	}
 
-	free(tmp);
+	its.it_interval.tv_sec = interval / 1000000000LL;
+	its.it_interval.tv_nsec = interval % 1000000000LL;
+	its.it_value = its.it_interval;
+	timerfd_settime(src->fd, 0, &its, NULL);
 
-	if (rc < 0) {
-		fprintf(stderr, "Error: Could not read from %s\n", pretty_name(f->name));
-		goto out;
-	}
+	add_source(src, handler);
+}
 
-	/* Skip unneeded buffers */
-	for (tmp = first; total_bytes - tmp->n_bytes > n_bytes; tmp = tmp->next)
-		total_bytes -= tmp->n_bytes;
+/* Acknowledge the expiration of a timer */
+static void timer_ack(struct ev_source *src)
+{
+	unsigned long long expirations;
 
-	/* Read too many bytes, advance */
-	if (total_bytes > n_bytes)
-		i = total_bytes - n_bytes;
+	if (read_counted(src->fd, &expirations, sizeof(expirations)) < 0)
+		dprintf("D: Could not read timer (%s)\n", strerror(errno));
+}
 
-	if ((rc = write(STDOUT_FILENO, &tmp->buf[i], tmp->n_bytes - i)) <= 0) {
-		/* e.g. when writing to a pipe which gets closed */
-		fprintf(stderr, "Error: Could not write to stdout (%s)\n", strerror(errno));
-		goto out;
-	}
+static void handle_flush_timer(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	timer_ack(src);
+	if (!out_stalled)
+		out_flush();
+}
 
-	for (tmp = tmp->next; tmp; tmp = tmp->next)
-		if ((rc = write(STDOUT_FILENO, tmp->buf, tmp->n_bytes)) <= 0) {
-			fprintf(stderr, "Error: Could not write to stdout (%s)\n", strerror(errno));
-			goto out;
-		}
+static void handle_state_timer(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	timer_ack(src);
 
+	/* Queued output is not output yet, try again next time */
+	if (state_dirty && out.len == 0)
+		state_save();
+}
 
-	rc = 0;
-out:
-	while (first) {
-		tmp = first->next;
-		free(first);
-		first = tmp;
-	}
+static void handle_stats_timer(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	timer_ack(src);
+	stats_save();
+}
 
-	return rc;
+/* stdout takes data again */
+static void handle_stdout(struct ev_source *src __attribute__((unused)),
+			  unsigned events __attribute__((unused)))
+{
+	out_stall(0);
+	out_flush();
 }
 
-static int tail_file(struct file_struct *f, unsigned long n_units, char mode)
+/* Make a pipe or socket on stdout non-blocking, so a slow reader does not keep
+ * us from handling events */
+static void watch_stdout(void)
 {
-	ssize_t bytes_read = 0;
-	off_t offset = 0;
-	char *buf;
+	struct epoll_event ev;
 	struct stat finfo;
 
-	if (strcmp(f->name, "-") == 0)
-		f->fd = STDIN_FILENO;
-	else {
-		f->fd = open(f->name, O_RDONLY|O_LARGEFILE);
-		if (unlikely(f->fd < 0)) {
-			fprintf(stderr, "Error: Could not open file '%s' (%s)\n", f->name, strerror(errno));
-			return -1;
-		}
+	if (fstat(STDOUT_FILENO, &finfo) < 0 || !(S_ISFIFO(finfo.st_mode) || S_ISSOCK(finfo.st_mode)))
+		return;
+
+	stdout_flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (stdout_flags < 0 || fcntl(STDOUT_FILENO, F_SETFL, stdout_flags | O_NONBLOCK) < 0)
+		return;
+
+	/* Only watched for EPOLLOUT while stalled */
+	ev.events = 0;
+	ev.data.ptr = &stdout_src;
+	stdout_src.fd = STDOUT_FILENO;
+	stdout_src.handler = handle_stdout;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, STDOUT_FILENO, &ev) < 0) {
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+		stdout_src.fd = -1;
+		return;
 	}
 
-	if (fstat(f->fd, &finfo) < 0) {
-		fprintf(stderr, "Error: Could not stat file '%s' (%s)\n", f->name, strerror(errno));
-		return -1;
-	}
+	out_blocking = 0;
+}
 
-	if (!IS_TAILABLE(finfo.st_mode)) {
-		fprintf(stderr, "Error: '%s' of unsupported file type\n", f->name);
-		return -1;
-	}
+/* Read and handle all queued inotify events */
+static void read_events(struct ev_source *src)
+{
+	int full = 0;
+	ssize_t len;
 
-	/* Cannot seek on these */
-	if (IS_PIPELIKE(finfo.st_mode) || f->fd == STDIN_FILENO) {
-		if (verbose)
-			write_header(f->name);
+	while (following() && (len = read_counted(src->fd, ev_buf, ev_buf_len)) != 0) {
+		ssize_t ev_idx = 0;
 
-		if (mode == M_LINES)
-			return tail_pipe_lines(f, n_units);
-		else
-			return tail_pipe_bytes(f, n_units);
-	}
+		if (unlikely(len < 0)) {
+			/* Drained the queue or interrupted by some signal,
+			 * likely ^Z/fg's STOP and CONT */
+			if (errno == EAGAIN)
+				break;
+			else if (errno == EINTR)
+				continue;
 
-	f->size = finfo.st_size;
-	if (likely(finfo.st_blksize > 0))
-		f->blksize = finfo.st_blksize;
+			fprintf(stderr, "Error: Could not read inotify events (%s)\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-	if (mode == M_LINES)
-		offset = lines_to_offset(f, n_units);
-	else
-		offset = bytes_to_offset(f, n_units);
+		event_time = coalesce_delay ? coalesce_start : now_ns();
 
-	/* We only get negative offsets on errors */
-	if (unlikely(offset < 0))
-		return -1;
+		while (ev_idx < len) {
+			struct inotify_event *inev;
+			struct file_struct *f;
+			struct dir_struct *d;
+			int ret = 0;
 
-	if (lseek(f->fd, offset, SEEK_SET) == (off_t) -1) {
-		fprintf(stderr, "Error: Could not seek in file '%s' (%s)\n", f->name, strerror(errno));
-		return -1;
+			inev = (struct inotify_event *) &ev_buf[ev_idx];
+			ev_idx += sizeof(struct inotify_event) + inev->len;
+			stats.events++;
+
+			/* Which file or directory has produced the event? */
+			if (unlikely(inev->mask & IN_Q_OVERFLOW))
+				resync_files();
+			else if ((f = file_by_wd(inev->wd)))
+				ret = handle_file_event(inev, f);
+			else if ((d = dir_by_wd(inev->wd)))
+				ret = handle_dir_event(inev, d);
+			/* Spurious event otherwise, skip */
+
+			if (ret < 0 && !following())
+				/* Got an error handling the event and no files
+				 * left unignored */
+				return;
+		}
+
+		/* The queue was drained unless the buffer is full, epoll tells
+		 * about events coming in since */
+		if ((size_t) len <= ev_buf_len - INOTIFY_EVENT_MAX)
+			break;
+
+		/* The buffer was full and the read before filled it as well,
+		 * events are coming in faster than we read them. Read more at
+		 * once next time. A single full read doesn't count, with one
+		 * file the buffer only has room for one event. */
+		if (full && ev_buf_len < INOTIFY_BUFLEN_MAX) {
+			ev_buf_len *= 2;
+			ev_buf = erealloc(ev_buf, ev_buf_len);
+		}
+		full = 1;
 	}
+}
 
-	if (verbose)
-		write_header(f->name);
+/* Start or stop waiting for inotify events in the main loop */
+static void watch_inotify(int watch)
+{
+	struct epoll_event ev;
 
-	buf = emalloc(f->blksize);
+	ev.events = watch ? EPOLLIN : 0;
+	ev.data.ptr = &inotify_src;
+	stats.syscalls++;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, inotify_src.fd, &ev) < 0)
+		dprintf("D: Could not watch inotify (%s)\n", strerror(errno));
+}
 
-	while ((bytes_read = read(f->fd, buf, f->blksize)) > 0)
-		write(STDOUT_FILENO, buf, (size_t) bytes_read);
+/*
+ * With --coalesce, events are not read as soon as they come in, but
+ * coalesce_delay after the first of them. In the meantime, the kernel merges
+ * repeated events of a file and the others pile up to be read at once. Files
+ * then get a single turn no matter how many events they had, see
+ * file_modified().
+ */
+static void handle_inotify(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
 
-	if (!follow) {
-		if (close(f->fd) < 0) {
-			fprintf(stderr, "Error: Could not close file '%s' (%s)\n", f->name, strerror(errno));
-			free(buf);
-			return -1;
-		}
+	if (!coalesce_delay) {
+		read_events(src);
+		return;
 	}
-	/* Let the fd open otherwise, we'll need it */
 
-	free(buf);
-	return 0;
+	coalesce_start = now_ns();
+	watch_inotify(0);
+	its.it_value.tv_sec = coalesce_delay / 1000000000LL;
+	its.it_value.tv_nsec = coalesce_delay % 1000000000LL;
+	stats.syscalls++;
+	timerfd_settime(coalesce_src.fd, 0, &its, NULL);
 }
 
-static int handle_inotify_event(int ifd, struct inotify_event *inev, struct file_struct *f)
+static void handle_coalesce_timer(struct ev_source *src, unsigned events __attribute__((unused)))
 {
-	int ret = 0;
+	timer_ack(src);
+	watch_inotify(1);
+	read_events(&inotify_src);
+}
 
-	if (inev->mask & (IN_MODIFY|IN_CREATE)) {
-		char *fbuf;
-		ssize_t bytes_read;
-		struct stat finfo;
-
-		if (f->fd < 0) {
-			fprintf(stderr, "File '%s' needs to get reopened.\n", f->name);
-			f->fd = open(f->name, O_RDONLY);
-			if (unlikely(f->fd < 0)) {
-				fprintf(stderr, "Error: Could not open file '%s' (%s)\n", f->name, strerror(errno));
-				ignore_file(f);
-				return -1;
-			}
+static void handle_signal(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	struct signalfd_siginfo si;
 
-			/* File got rotated away, so start again */
-			f->size = 0;
-		}
+	if (read(src->fd, &si, sizeof(si)) != sizeof(si))
+		return;
 
-		if (verbose)
-			write_header(f->name);
+	if (si.ssi_signo == SIGUSR1)
+		stats_write(stderr);
+	else
+		quit = si.ssi_signo;
+}
 
-		if ((ret = fstat(f->fd, &finfo)) < 0) {
-			fprintf(stderr, "Error: Could not stat file '%s' (%s)\n", f->name, strerror(errno));
-			goto ignore;
-		}
+/* The writer given by --pid is gone, output what it wrote last and exit */
+static void writer_died(void)
+{
+	int i;
 
-		/* Regular file got truncated */
-		if (S_ISREG(finfo.st_mode) && finfo.st_size < f->size) {
-			fprintf(stderr, "File '%s' truncated\n", f->name);
-			f->size = finfo.st_size;
-		}
+	dprintf("D: Process %d died\n", writer_pid);
 
-		/* Seek to old file size */
-		if (!IS_PIPELIKE(finfo.st_mode) && (ret = lseek(f->fd, f->size, SEEK_SET)) == (off_t) -1) {
-			fprintf(stderr, "Error: Could not seek in file '%s' (%s)\n", f->name, strerror(errno));
-			goto ignore;
-		}
+	for (i = 0; i < n_files; i++)
+		if (!files[i]->ignore && files[i]->fd >= 0)
+			follow_file(files[i], COPY_ALL);
 
-		fbuf = emalloc(f->blksize);
+	quit = -1;
+}
 
-		while ((bytes_read = read(f->fd, fbuf, f->blksize)) != 0) {
-			write(STDOUT_FILENO, fbuf, (size_t) bytes_read);
-			f->size += bytes_read;
-		}
+static void handle_pidfd(struct ev_source *src __attribute__((unused)),
+			 unsigned events __attribute__((unused)))
+{
+	writer_died();
+}
 
-		free(fbuf);
-		return ret;
-	} else if (inev->mask & (IN_DELETE_SELF|IN_MOVE_SELF)) {
-		inotify_rm_watch(ifd, f->i_watch);
-		close(f->fd);
-		f->fd = -1;
+/* Without pidfd support, poll for the writer to be gone */
+static void handle_pid_timer(struct ev_source *src, unsigned events __attribute__((unused)))
+{
+	timer_ack(src);
 
-		if (inev->mask & IN_DELETE_SELF)
-			fprintf(stderr, "File '%s' deleted.\n", f->name);
-		else
-			fprintf(stderr, "File '%s' moved.\n", f->name);
-
-		/* TODO: This should only be done in FOLLOW_NAME mode, also we
-		 * should watch the containing directory until the file
-		 * reappears and only then try to install the new watch
-		 */
-		f->i_watch = inotify_add_watch(ifd, f->name, INOTAIL_WATCH_MASK);
-		if (f->i_watch < 0) {
-			fprintf(stderr, "Error: Could not create inotify watch on file '%s' (%s)\n",
-					f->name, strerror(errno));
-			ignore_file(f);
-			return -1;
-		}
+	if (kill(writer_pid, 0) < 0 && errno == ESRCH)
+		writer_died();
+}
 
-		return 0;
-	} else if (inev->mask & IN_UNMOUNT) {
-		fprintf(stderr, "Device containing file '%s' unmounted.\n", f->name);
-	} else if (inev->mask & IN_IGNORED) {
-		return 0;
+static void watch_pid(void)
+{
+#ifdef SYS_pidfd_open
+	pid_src.fd = syscall(SYS_pidfd_open, writer_pid, 0);
+	if (pid_src.fd >= 0) {
+		add_source(&pid_src, handle_pidfd);
+		return;
+	}
+#else
+	errno = ENOSYS;
+#endif
+	if (errno == ESRCH) {
+		writer_died();
+		return;
 	}
 
-ignore:
-	ignore_file(f);
-	return ret;
+	dprintf("D: No pidfd support (%s), polling PID %d\n", strerror(errno), writer_pid);
+	add_timer(&pid_src, handle_pid_timer, PID_CHECK_INTERVAL);
 }
 
-static int watch_files(struct file_struct *files, int n_files)
+static int watch_files(void)
 {
-	int ifd, i;
-	char *buf = emalloc(n_files * INOTIFY_BUFLEN);
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct glob_pat *g;
+	sigset_t mask;
+	int i;
 
-	ifd = inotify_init();
+	ifd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
 	if (errno == ENOSYS) {
 		fprintf(stderr, "Error: inotify is not supported by the kernel you're currently running.\n");
 		exit(EXIT_FAILURE);
@@ -718,77 +4903,152 @@ static int watch_files(struct file_struct *files, int n_files)
 		exit(EXIT_FAILURE);
 	}
 
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (unlikely(epfd < 0)) {
+		fprintf(stderr, "Error: Could not initialize epoll (%s)\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	htable_init(&wd_table, n_files);
+	htable_init(&dir_wd_table, 0);
+	htable_init(&dir_path_table, 0);
+	htable_init(&name_table, n_files);
+
 	for (i = 0; i < n_files; i++) {
-		if (!files[i].ignore) {
-			files[i].i_watch = inotify_add_watch(ifd, files[i].name, INOTAIL_WATCH_MASK);
+		if (files[i]->ignore)
+			continue;
 
-			if (files[i].i_watch < 0) {
-				fprintf(stderr, "Error: Could not create inotify watch on file '%s' (%s)\n",
-						files[i].name, strerror(errno));
-				ignore_file(&files[i]);
-			}
+		if (follow == FOLLOW_NAME || files[i]->glob) {
+			if (attach_dir(files[i]) < 0)
+				ignore_file(files[i]);
+		} else if (add_watch(files[i]) < 0) {
+			fprintf(stderr, "Error: Could not create inotify watch on file '%s' (%s)\n",
+					files[i]->name, strerror(errno));
+			ignore_file(files[i]);
 		}
 	}
 
-	while (n_ignored < n_files) {
-		ssize_t len;
-		int ev_idx = 0;
+	/* Watch for files matching --glob to appear */
+	for (g = globs; g; g = g->next) {
+		g->dir = get_dir(glob_dir_path(g));
+		if (g->dir)
+			n_globs++;
+	}
 
-		len = read(ifd, buf, (n_files * INOTIFY_BUFLEN));
-		if (unlikely(len < 0)) {
-			/* Some signal, likely ^Z/fg's STOP and CONT interrupted the inotify read, retry */
-			if (errno == EINTR || errno == EAGAIN)
-				continue;
-			else {
-				fprintf(stderr, "Error: Could not read inotify events (%s)\n", strerror(errno));
-				close(ifd);
-				exit(EXIT_FAILURE);
-			}
-		}
+	inotify_src.fd = ifd;
+	add_source(&inotify_src, handle_inotify);
+	ev_buf_len = n_files * INOTIFY_BUFLEN;
+	if (ev_buf_len < INOTIFY_EVENT_MAX)
+		ev_buf_len = INOTIFY_EVENT_MAX;
+	else if (ev_buf_len > INOTIFY_BUFLEN_MAX)
+		ev_buf_len = INOTIFY_BUFLEN_MAX;
+	ev_buf = emalloc(ev_buf_len);
+
+	/* Terminating signals are handled in the loop, so we can clean up.
+	 * SIGUSR1 dumps the statistics. */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal_src.fd = signalfd(-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (signal_src.fd >= 0)
+		add_source(&signal_src, handle_signal);
+
+	if (writer_pid)
+		watch_pid();
+
+	watch_stdout();
+
+	/* Keep the lines of several files apart */
+	if (n_files > 1 || globs)
+		line_atomic = 1;
+	if (line_atomic || !out_blocking) {
+		out.size = OUTPUT_FLUSH_SIZE;
+		out.buf = emalloc(out.size);
+		add_timer(&flush_src, handle_flush_timer, 0);
+	}
 
-		while (ev_idx < len) {
-			struct inotify_event *inev;
-			struct file_struct *f = NULL;
+	if (state_file)
+		add_timer(&state_src, handle_state_timer, STATE_INTERVAL);
+	if (stats_file)
+		add_timer(&stats_src, handle_stats_timer, STATS_INTERVAL);
+	if (coalesce_delay)
+		add_timer(&coalesce_src, handle_coalesce_timer, 0);
+
+#ifdef DEBUG
+	n_allocs = 0;
+#endif
+
+	while (following() && !quit) {
+		/* Don't block while files are waiting for their turn */
+		int n_events = epoll_wait(epfd, events, MAX_EPOLL_EVENTS,
+					  (ready_head && !out_stalled) ? 0 : -1);
+
+		stats.syscalls++;
+		if (unlikely(n_events < 0)) {
+			/* Interrupted by some signal, e.g. ^Z/fg's STOP and CONT */
+			if (errno == EINTR)
+				continue;
 
-			inev = (struct inotify_event *) &buf[ev_idx];
+			fprintf(stderr, "Error: Could not wait for events (%s)\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-			/* Which file has produced the event? */
-			for (i = 0; i < n_files; i++) {
-				if (!files[i].ignore && files[i].i_watch == inev->wd) {
-					f = &files[i];
-					break;
-				}
-			}
+		for (i = 0; i < n_events && !quit; i++) {
+			struct ev_source *src = events[i].data.ptr;
 
-			/* Spurious event, skip */
-			if (unlikely(!f)) {
-				ev_idx += sizeof(struct inotify_event) + inev->len;
-				continue;
-			}
+			src->handler(src, events[i].events);
+		}
 
-			if (handle_inotify_event(ifd, inev, f) < 0 && n_ignored == n_files)
-				/* Got an error handling the event and no files
-				 * left unignored */
-				break;
+		if (ready_head && !quit && !out_stalled)
+			run_ready();
 
-			ev_idx += sizeof(struct inotify_event) + inev->len;
+#ifdef DEBUG
+		/* The buffers needed while following are all allocated upfront */
+		if (unlikely(n_allocs > 0)) {
+			dprintf("D: %lu heap allocations while following files\n", n_allocs);
+			n_allocs = 0;
 		}
+#endif
 	}
 
-	free(buf);
+	/* Whatever is left goes out before we do */
+	out_blocking = 1;
+	out_flush();
+	free(out.buf);
+	if (stdout_src.fd >= 0)
+		fcntl(STDOUT_FILENO, F_SETFL, stdout_flags);
+	state_save();
+	stats_save();
+	free(wd_table.buckets);
+	free(dir_wd_table.buckets);
+	free(dir_path_table.buckets);
+	free(name_table.buckets);
+	close(epfd);
 	close(ifd);
 
-	return -1;
+	/* Terminate the way we would have without handling the signal */
+	if (quit > 0) {
+		signal(quit, SIG_DFL);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		raise(quit);
+	}
+
+	return (quit < 0 && following()) ? 0 : -1;
 }
 
 int main(int argc, char **argv)
 {
 	int i, c, option_idx, ret = 0;
-	int n_files;
 	unsigned long n_units = DEFAULT_N_LINES;
-	char mode = M_LINES;
+	char mode = M_LINES, units_arg = 0;
 	char **filenames;
-	struct file_struct *files = NULL;
+	struct glob_pat *g;
+	int n_names;
+
+	init_scanners();
 
 	while ((c = getopt_long(argc, argv, "c:n:fFqvVhs:", long_opts, &option_idx)) != -1) {
 		switch (c) {
@@ -809,6 +5069,7 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			n_units = strtoul(optarg, NULL, 0);
+			units_arg = 1;
 			break;
                 case 'f':
 			/* Just -f or --follow=descriptor */
@@ -835,6 +5096,35 @@ int main(int argc, char **argv)
 		case RETRY_OPTION:
 			retry = 1;
 			break;
+		case HUGEPAGES_OPTION:
+			hugepages = 1;
+			break;
+		case DIRECT_OPTION:
+			direct_io = 1;
+			/* fall through */
+		case NOCACHE_OPTION:
+			nocache = 1;
+			break;
+		case PREFETCH_OPTION:
+			prefetch = 1;
+			break;
+		case PARALLEL_OPTION:
+			if (!optarg) {
+				n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+				if (n_threads < 1)
+					n_threads = 1;
+				break;
+			}
+			n_threads = strtol(optarg, NULL, 10);
+			if (!is_digit(*optarg) || n_threads <= 0 || n_threads > PARALLEL_MAX_THREADS) {
+				fprintf(stderr, "Error: Invalid number of threads: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case LINE_INDEX_OPTION:
+			line_index = 1;
+			line_index_dir = optarg;
+			break;
 		case 'V':
 			fprintf(stdout, "%s %s\n", PROGRAM_NAME, VERSION);
 			exit(EXIT_SUCCESS);
@@ -848,8 +5138,62 @@ int main(int argc, char **argv)
 			fprintf(stderr, "Warning: Option '-s' has no effect, ignoring\n");
 			break;
 		case PID_OPTION:
-			/* Watching the PID is not possible because of the
-			 * blocking read on the inotify fd */
+			writer_pid = strtol(optarg, NULL, 10);
+			if (!is_digit(*optarg) || writer_pid <= 0) {
+				fprintf(stderr, "Error: Invalid PID: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case MATCH_OPTION:
+			add_filter(&match_filters, optarg);
+			break;
+		case EXCLUDE_OPTION:
+			add_filter(&exclude_filters, optarg);
+			break;
+		case MAX_BACKLOG_OPTION:
+			if (parse_size(optarg, &max_backlog) < 0) {
+				fprintf(stderr, "Error: Invalid size: %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case BACKLOG_POLICY_OPTION:
+			if (strcmp(optarg, "block") == 0)
+				backlog_policy = BACKLOG_BLOCK;
+			else if (strcmp(optarg, "drop-oldest") == 0)
+				backlog_policy = BACKLOG_DROP_OLDEST;
+			else if (strcmp(optarg, "skip") == 0)
+				backlog_policy = BACKLOG_SKIP;
+			else {
+				fprintf(stderr, "Error: Invalid argument '%s' for --backlog-policy.\n"
+						"Try '%s --help' for more information\n", optarg, PROGRAM_NAME);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case STATE_FILE_OPTION:
+			state_file = optarg;
+			break;
+		case GLOB_OPTION:
+			add_glob(optarg);
+			break;
+		case STATS_FILE_OPTION:
+			stats_file = optarg;
+			break;
+		case COALESCE_OPTION:
+			if (parse_coalesce(optarg) < 0) {
+				fprintf(stderr, "Error: Invalid argument '%s' for --coalesce.\n"
+						"Try '%s --help' for more information\n", optarg, PROGRAM_NAME);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case SINCE_OPTION:
+			since_arg = optarg;
+			break;
+		case UNTIL_OPTION:
+			until_arg = optarg;
+			break;
+		case TIME_FORMAT_OPTION:
+			time_format = optarg;
+			break;
 		case MAX_UNCHANGED_STATS_OPTION:
 			/* inotail (will) watch the containing directory for the
 			 * file being moved or deleted, so there is no need for
@@ -861,14 +5205,34 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Times are parsed according to --time-format, wherever it was given */
+	if (since_arg && parse_time_arg(since_arg, &since) < 0) {
+		fprintf(stderr, "Error: Invalid time: %s\n", since_arg);
+		exit(EXIT_FAILURE);
+	}
+	if (since_arg && units_arg) {
+		fprintf(stderr, "Error: --since cannot be used together with -n or -c\n");
+		exit(EXIT_FAILURE);
+	}
+	if (until_arg) {
+		if (parse_time_arg(until_arg, &until) < 0) {
+			fprintf(stderr, "Error: Invalid time: %s\n", until_arg);
+			exit(EXIT_FAILURE);
+		}
+		if (follow) {
+			fprintf(stderr, "Error: --until cannot be used when following files\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* Do we have some files to read from? */
-	if (optind < argc) {
-		n_files = argc - optind;
+	if (optind < argc || globs) {
+		n_names = argc - optind;
 		filenames = argv + optind;
 	} else {
 		/* It must be stdin then */
 		static char *dummy_stdin = "-";
-		n_files = 1;
+		n_names = 1;
 		filenames = &dummy_stdin;
 
 		/* POSIX says that -f is ignored if no file operand is
@@ -887,19 +5251,37 @@ int main(int argc, char **argv)
 		}
 	}
 
-	files = emalloc(n_files * sizeof(struct file_struct));
+	setup_output();
+	io_buffer(SCAN_WINDOW);
+
+	if (state_file)
+		state_load();
+
+	for (i = 0; i < n_names; i++)
+		add_file(filenames[i]);
+	for (g = globs; g; g = g->next)
+		expand_glob(g);
+	if (globs || n_files > 64)
+		raise_nofile_limit();
+	/* Warming the page cache is just what --nocache is to avoid */
+	if (prefetch && !nocache && n_files > 1)
+		prefetch_files(n_units, mode);
 
 	for (i = 0; i < n_files; i++) {
-		files[i].name = filenames[i];
-		setup_file(&files[i]);
-		ret = tail_file(&files[i], n_units, mode);
-		if (ret < 0)
-			ignore_file(&files[i]);
+		ret = tail_file(files[i], n_units, mode);
+		/* Wait for inaccessible files to appear when following by
+		 * name with --retry */
+		if (ret < 0 && !(follow == FOLLOW_NAME && retry && files[i]->fd < 0))
+			ignore_file(files[i]);
 	}
 
 	if (follow)
-		ret = watch_files(files, n_files);
+		ret = watch_files();
+	else
+		state_save();
 
+	for (i = 0; i < n_files; i++)
+		free_file(files[i]);
 	free(files);
 
 	return ret;
@@ -8,16 +8,112 @@
 #ifndef _INOTAIL_H
 #define _INOTAIL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <regex.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/inotify.h>
 
 /* Number of items to tail. */
 #define DEFAULT_N_LINES		10
+/* Size of the window read at once when scanning a file for newlines */
+#define SCAN_WINDOW		(256 * 1024)
+/* Size of a huge page used for the I/O buffer */
+#define HUGEPAGE_SIZE		(2 * 1024 * 1024)
+/* Bytes a followed file may output per turn before other files get theirs */
+#define FOLLOW_QUANTUM		(256 * 1024)
+/* Let copy_to_stdout() copy until EOF */
+#define COPY_ALL		((off_t) -1)
+/* Largest possible file offset */
+#define OFF_T_MAX		((off_t) (~0ULL >> 1))
+
+/* Lines between the offsets recorded in a line index */
+#define LINE_INDEX_STRIDE	16384
+/* Only files at least this big get a line index */
+#define LINE_INDEX_THRESHOLD	(1024 * 1024)
+/* Identifies line index files, the last character is the format version */
+#define LINE_INDEX_MAGIC	"INOTIDX1"
+/* Name suffix of line index files */
+#define LINE_INDEX_SUFFIX	".inotail-index"
+
+/* Files are counted in parallel in chunks of this size */
+#define PARALLEL_CHUNK		(8 * 1024 * 1024)
+/* Chunks per thread counted before looking at the counts */
+#define PARALLEL_ROUND		4
+/* Only count in parallel if at least this much is left to count */
+#define PARALLEL_THRESHOLD	(64 * 1024 * 1024)
+/* Maximum number of threads for --parallel */
+#define PARALLEL_MAX_THREADS	256
+
+/* Default format of timestamps for --since/--until (ISO 8601) */
+#define DEFAULT_TIME_FORMAT	"%Y-%m-%dT%H:%M:%S"
+/* Bytes at the beginning of a line considered to contain the timestamp */
+#define TIME_PREFIX_MAX		128
+/* Ranges at most this big are searched sequentially for a timestamp */
+#define TIME_SEEK_LINEAR	(16 * 1024)
+
+/* Maximum number of runs of matching lines written at once */
+#define FILTER_IOV		64
+
+/* Output of several followed files is written once this much is queued */
+#define OUTPUT_FLUSH_SIZE	(64 * 1024)
+/* ... or this long after the first of it was queued (ns) */
+#define OUTPUT_FLUSH_DELAY	5000000L
+
+/* Default time inotify events are left to pile up with --coalesce (ns) */
+#define COALESCE_DELAY		5000000LL
+
+/* Bytes a followed file may fall behind a slow reader by default */
+#define DEFAULT_MAX_BACKLOG	(16 * 1024 * 1024)
+
+/* Files opened and read ahead at once when prefetching */
+#define PREFETCH_DEPTH		64
+/* Threads prefetching files if io_uring is not available */
+#define PREFETCH_THREADS	16
+
+/* Interval between writing the --state-file while following (ns) */
+#define STATE_INTERVAL		1000000000LL
+/* First line of state files, the number is the format version */
+#define STATE_MAGIC		"inotail-state 1"
+
+/* Interval between writing the --stats-file while following (ns) */
+#define STATS_INTERVAL		1000000000LL
+/* Buckets of the output latency histogram, bucket i counts latencies up to
+ * 2^i microseconds, one more for anything longer */
+#define LATENCY_BUCKETS		24
+
+/* Interval to check whether the writer is alive without pidfd support (ns) */
+#define PID_CHECK_INTERVAL	1000000000LL
+/* Maximum number of epoll events handled at once */
+#define MAX_EPOLL_EVENTS	16
+/* Regular files at least this big are tailed using mmap() */
+#define MMAP_THRESHOLD		(1024 * 1024)
+/* Maximum size of a single mapping when tailing using mmap() */
+#define MMAP_WINDOW		(64 * 1024 * 1024)
+/* Initial size of the ring buffer used to tail non-seekable files */
+#define RING_SIZE		(64 * 1024)
+/* Maximum size of a ring buffer segment */
+#define RING_SEG		(64 * 1024)
+/* Maximum number of bytes to copy to stdout in one system call */
+#define COPY_CHUNK		(16 * 1024 * 1024)
+/* With --nocache, data read is dropped from the page cache in steps this big */
+#define DROP_BEHIND		(8 * 1024 * 1024)
+/* Alignment of offsets, lengths and buffers of reads with --direct */
+#define DIRECT_ALIGN		4096
 /* inotify event buffer length for one file */
 #define INOTIFY_BUFLEN		(4 * sizeof(struct inotify_event))
+/* Room for at least one inotify event with the longest name */
+#define INOTIFY_EVENT_MAX	(sizeof(struct inotify_event) + NAME_MAX + 1)
+/* Upper bound the inotify read buffer may grow to */
+#define INOTIFY_BUFLEN_MAX	(1024 * 1024)
 /* inotify events to watch for on tailed files */
 #define INOTAIL_WATCH_MASK	\
 	(IN_MODIFY|IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_CREATE)
+/* inotify events to watch for on directories of files followed by name */
+#define INOTAIL_DIR_WATCH_MASK	\
+	(IN_MODIFY|IN_CREATE|IN_MOVED_TO|IN_MOVED_FROM|IN_DELETE| \
+	 IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT|IN_ONLYDIR)
 
 /* tail modes */
 enum tail_mode { M_LINES, M_BYTES };
@@ -28,14 +124,223 @@ enum follow_mode {
 	FOLLOW_NAME		/* Follow the file by name */
 };
 
+/* what to do about followed files falling behind */
+enum backlog_policy {
+	BACKLOG_BLOCK = 0,	/* Keep all of it, wait for stdout */
+	BACKLOG_DROP_OLDEST,	/* Drop the oldest lines */
+	BACKLOG_SKIP		/* Skip to the end, output a marker line */
+};
+
+/* ways of copying file data to stdout */
+enum copy_method {
+	COPY_RW = 0,		/* read()/write() through a buffer */
+	COPY_SPLICE,		/* splice() into a pipe */
+	COPY_SENDFILE,		/* sendfile() into a socket or file */
+	COPY_FILE_RANGE		/* copy_file_range() into a file */
+};
+
+/* Node of a hash table chain, embedded into the hashed structure */
+struct hnode {
+	struct hnode *next;
+	unsigned long hash;
+};
+
+/* Hash table with chaining, size is always a power of two */
+struct htable {
+	struct hnode **buckets;
+	unsigned long mask;	/* Number of buckets - 1 */
+	unsigned long count;	/* Number of hashed nodes */
+};
+
+/* Directory watched for the files in it which are followed by name */
+struct dir_struct {
+	char *path;
+	int wd;			/* Inotify watch on the directory */
+	unsigned refs;		/* Number of files followed in the directory */
+	struct hnode wd_node;	/* Entry in the directory watch table */
+	struct hnode path_node;	/* Entry in the directory path table */
+};
+
+/* Pattern given to --glob, see add_glob() */
+struct glob_pat {
+	struct glob_pat *next;
+	char *prefix;		/* Directory part including the trailing '/' */
+	const char *pattern;	/* Last component, matched with fnmatch() */
+	struct dir_struct *dir;	/* Watched directory or NULL */
+};
+
+/* Header of a line index file, followed by n_offsets offsets of the lines
+ * following every stride'th newline in the file */
+struct line_index {
+	char magic[8];		/* LINE_INDEX_MAGIC */
+	uint32_t stride;	/* Lines between offsets */
+	uint32_t reserved;
+	uint64_t dev;		/* Device of the indexed file */
+	uint64_t ino;		/* Inode of the indexed file */
+	uint64_t size;		/* Bytes of the file indexed so far */
+	int64_t mtime_sec;	/* Modification time of the file when it had */
+	int64_t mtime_nsec;	/* size bytes */
+	uint64_t n_lines;	/* Newlines in the indexed bytes */
+	uint64_t n_offsets;	/* Number of offsets following the header */
+};
+
+/* Chunks of a file counted in parallel */
+struct count_job {
+	struct file_struct *f;
+	off_t start;		/* Offset of the first chunk */
+	size_t n_chunks;	/* Number of chunks to count */
+	size_t next;		/* Next chunk to count */
+	unsigned long *counts;	/* Newlines per chunk */
+	int error;		/* errno if reading failed */
+};
+
+/* Files to prefetch, see prefetch_files() */
+struct prefetch_job {
+	unsigned long n_units;
+	char mode;
+	int next;		/* Next file to prefetch */
+};
+
+/* File being prefetched through io_uring */
+struct prefetch_slot {
+	int file;		/* Index in the table of files */
+	int reading;		/* Opened, reading ahead */
+	char *buf;
+};
+
+/* io_uring instance set up by uring_init() */
+struct uring {
+	int fd;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned tail;		/* Submission queue tail not yet published */
+	unsigned to_submit;
+};
+
+/* Ring buffer collecting the tail of n_units lines or bytes, see ring_sink() */
+struct ring_fill {
+	struct ring *r;
+	unsigned long n_units;
+	char mode;
+};
+
+/* Line filter given by --match or --exclude */
+struct filter {
+	struct filter *next;
+	const char *pattern;
+	size_t len;		/* Length of pattern */
+	int is_regex;		/* Match re instead of the literal pattern? */
+	regex_t re;
+	const char *hit;	/* Next occurrence of the literal pattern */
+};
+
+/* Incomplete line carried over to the next read when filtering lines */
+struct line_buf {
+	char *buf;
+	size_t len;
+	size_t size;		/* Allocated size */
+};
+
+/* Consumer of the runs of matching lines found by filter_lines() */
+typedef int (*line_sink)(void *arg, struct iovec *iov, int n_iov);
+
+/* Output collected before being written at once, see out_append() */
+struct outq {
+	char *buf;
+	size_t len;
+	size_t size;		/* Allocated size */
+};
+
+/* Offset a file was output up to in an earlier run, see state_load() */
+struct state_entry {
+	char *name;
+	dev_t dev;
+	ino_t ino;
+	off_t offset;
+};
+
+/* Counters kept for each file, see stats_write() */
+struct file_stats {
+	unsigned long long events;	/* inotify events */
+	unsigned long long bytes_read;	/* Bytes output while following */
+	unsigned long long rotations;	/* Replaced by a new file */
+	unsigned long long truncations;
+};
+
+/* Counters of the whole process */
+struct stats {
+	unsigned long long events;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;	/* Bytes written to stdout */
+	unsigned long long bytes_dropped;	/* Bytes skipped by --backlog-policy */
+	unsigned long long syscalls;		/* System calls while following */
+	unsigned long long rotations;
+	unsigned long long truncations;
+	unsigned long long overflows;		/* inotify event queue overflows */
+	unsigned long long coalesced;		/* Events merged by --coalesce */
+	/* Time from the event announcing data to its output (ns) */
+	unsigned long long latency[LATENCY_BUCKETS + 1];
+	unsigned long long latency_sum;
+	unsigned long long latency_count;
+};
+
+/* Source of events for the main loop, see add_source() */
+struct ev_source {
+	int fd;
+	void (*handler)(struct ev_source *src, unsigned events);
+};
+
 /* Every tailed file is represented as a file_struct */
 struct file_struct {
 	char *name;		/* Name of file (or '-' for stdin) */
 	int fd;			/* File descriptor (or -1 if file is not open) */
 	off_t size;		/* File size */
 	blksize_t blksize;	/* Blocksize for filesystem I/O */
+	mode_t mode;		/* Type of the file */
 	unsigned ignore;	/* Whether to ignore the file in further processing */
 	int i_watch;		/* Inotify watch associated with file_struct */
+	struct hnode wd_node;	/* Entry in the watch descriptor table */
+	struct dir_struct *dir;	/* Containing directory if followed by name */
+	const char *base;	/* Name of the file within dir */
+	struct hnode name_node;	/* Entry in the file name table */
+	struct file_struct *ready_next;	/* Next file in the ready queue */
+	unsigned ready;		/* Whether the file is in the ready queue */
+	struct line_buf carry;	/* Incomplete last line if filtering lines */
+	off_t skipped;		/* Bytes skipped but not yet reported as such */
+	unsigned cut;		/* Whether a line was cut short by skipping */
+	dev_t dev;		/* Device and inode of a regular file, recorded */
+	ino_t ino;		/* in the state file */
+	int idx;		/* Position in the table of files, -1 if removed */
+	unsigned glob;		/* Whether the file matched --glob */
+	unsigned long long since;	/* When the oldest event with data not
+					 * output yet came in (or 0) */
+	struct file_stats stats;
+	off_t dropped;		/* Output up to here was dropped from the page
+				 * cache, see --nocache */
+	unsigned sparse;	/* Whether the file has holes, see copy_data() */
+};
+
+/* Consecutive bytes in a ring buffer */
+struct ring_seg {
+	size_t len;		/* Number of bytes */
+	unsigned long n_lines;	/* Number of newlines */
+};
+
+/* Growable ring buffer holding the tail of a non-seekable file */
+struct ring {
+	char *buf;
+	size_t size;		/* Allocated size */
+	size_t start;		/* Index of the oldest byte */
+	size_t len;		/* Number of bytes held */
+	unsigned long n_lines;	/* Number of newlines held */
+	struct ring_seg *segs;	/* Segments, oldest first (ring of max_segs) */
+	size_t max_segs;
+	size_t seg_first;	/* Index of the oldest segment */
+	size_t n_segs;		/* Number of segments */
 };
 
 #define IS_PIPELIKE(mode) \
@@ -45,6 +350,9 @@ struct file_struct {
 #define IS_TAILABLE(mode) \
 	(S_ISREG(mode) || IS_PIPELIKE(mode) || S_ISCHR(mode))
 
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
 #ifdef __GNUC__
@@ -60,7 +368,7 @@ struct file_struct {
 #ifdef DEBUG
 # define dprintf(fmt, args...) fprintf(stderr, fmt, ##args)
 #else
-# define dprintf(fmt, args...)
+# define dprintf(fmt, args...) do { } while (0)
 #endif /* DEBUG */
 
 #endif /* _INOTAIL_H */
@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Check --since and --until, alone and together with -n and -c, on a small
+# timestamped log with continuation lines.
+#
+# Prints the failed checks and exits with 1 if there are any.
+#
+# Licensed under the terms of the GNU General Public License; version 2 or later.
+
+INOTAIL=$(readlink -f ${INOTAIL:-./inotail})
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+log="$dir/log"
+failed=0
+
+# One line every minute from 00:00 to 09:59, a continuation line after every
+# tenth of them
+i=0
+while [ $i -lt 600 ]; do
+	printf '2026-01-01T%02d:%02d:00 line %d\n' $((i / 60)) $((i % 60)) $i
+	[ $((i % 10)) -eq 9 ] && printf '  continued %d\n' $i
+	i=$((i + 1))
+done > "$log"
+
+# check NAME EXPECTED ARG...: compare the output of inotail ARG... log
+check() {
+	name=$1
+	expected=$2
+	shift 2
+
+	got=$($INOTAIL "$@" "$log" 2>&1)
+	if [ "$got" != "$expected" ]; then
+		echo "FAIL $name"
+		echo "  expected: $(echo "$expected" | head -3)"
+		echo "  got:      $(echo "$got" | head -3)"
+		failed=1
+	fi
+}
+
+check "--until alone" \
+"$(printf '2026-01-01T05:00:00 line 300')" \
+	--until=2026-01-01T05:00:00 -n 1
+
+check "--until with the default number of lines" \
+"$(sed -n '/line 290$/,/line 300$/p' "$log" | tail -n 10)" \
+	--until=2026-01-01T05:00:00
+
+check "--until with -n" \
+"$(printf '2026-01-01T04:59:00 line 299\n  continued 299\n2026-01-01T05:00:00 line 300')" \
+	-n 3 --until=2026-01-01T05:00:00
+
+check "--until with -c" \
+"$(printf '  continued 299\n2026-01-01T05:00:00 line 300')" \
+	-c 45 --until=2026-01-01T05:00:00
+
+check "--until with -n +N" \
+"$(printf '2026-01-01T00:01:00 line 1\n2026-01-01T00:02:00 line 2')" \
+	-n +2 --until=2026-01-01T00:02:30
+
+check "--until before the first line" \
+"" \
+	--until=2025-12-31T23:00:00
+
+check "--since and --until" \
+"$(printf '2026-01-01T01:09:00 line 69\n  continued 69\n2026-01-01T01:10:00 line 70')" \
+	--since=2026-01-01T01:09:00 --until=2026-01-01T01:10:59
+
+check "--since with -n" \
+"Error: --since cannot be used together with -n or -c" \
+	-n 5 --since=2026-01-01T01:00:00
+
+exit $failed